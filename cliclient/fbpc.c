@@ -2,20 +2,32 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef COMPRESSION
+#include <zstd.h>
+#endif
 #include "fbp.h"
 #include "bitmask.h"
 
@@ -26,182 +38,2855 @@
 #define	MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
+#define	IS_PAST(tf, tl)	(((tf).tv_sec == (tl).tv_sec) ? ((tf).tv_usec > (tl).tv_usec) : ((tf).tv_sec > (tl).tv_sec))
+#define	TIMEVAL_IS_ZERO(tv)	((tv).tv_sec == 0 && (tv).tv_usec == 0)
+#define	TIMEVAL_SUBSTRACT(th, tl)	(((th).tv_sec - (tl).tv_sec) * 1000000 + (th).tv_usec - (tl).tv_usec)
+#define	TIMEVAL_SET(tv, sec, usec)	do { (tv).tv_sec = sec; (tv).tv_usec = usec; } while(0)
+#define	TIMEVAL_CLEAR(tv)	TIMEVAL_SET((tv), 0, 0)
+#define	ROUNDUP(x, y)	((((x) + (y) - 1) / (y)) * (y))
+#define	TIMEVAL_ADD_USEC(tv, usec)	do { (tv).tv_usec += (usec); (tv).tv_sec += (tv).tv_usec / 1000000; (tv).tv_usec %= 1000000; } while(0)
+
+// A server that hasn't announced for this long is considered gone
+#define	SERVER_TIMEOUT_SEC	3
+
+/*
+ * A data packet past the end of an open file grows it up to that packet, but
+ * only from a server and by no more than GROW_WINDOW packets; larger growth
+ * waits for the next announcement.
+ */
+#define	GROW_WINDOW	65536
+
+/*
+ * Write-back: instead of writing every packet as it comes in, we collect them
+ * in WB_EXTENTS buffers per transfer, each for an aligned window of WB_PACKETS
+ * packets of the file. A buffer is written out once its window is complete,
+ * when a packet for another window needs it, or when nothing came in for it
+ * for WB_COLD_USEC, one pwrite() per contiguous run, by the writer thread.
+ * Packets are only set in the bitmask once they're written, so it always
+ * tells what is in the file; everything is written out before we request,
+ * verify or quit.
+ */
+#define	WB_EXTENTS	8
+#define	WB_PACKETS	64
+#define	WB_COLD_USEC	100000
+
+struct extent {
+	pkt_count first;        // first packet of the window, -1 if unused
+	int count;              // packets we have of it
+	bm_datatype have[BM_UNITS(WB_PACKETS)];
+	unsigned short size[WB_PACKETS];
+	struct timeval touched; // when the last packet came in
+	char *data;
+	struct transfer *t;     // whose it is, once it is in the pipeline
+	int finish;             // no data, the verifier hashes the rest of the file
+	off_t end;              // end of the data the writer wrote
+	long writes;            // ... in this many pwrite()s
+};
+
+/*
+ * Resuming: for every file that isn't still growing, we keep its bitmask in
+ * data/<filename>.fbpstate as well, mapped into memory; when imaging to a
+ * regular file with -o, in <file>.fbpstate next to it. Every sync_usec, and
+ * only when something changed, we sync the data file and then copy the
+ * bitmask over, so the state never claims packets that aren't on disk yet.
+ * A restarted fbpc checks that the state is for the file being announced
+ * and that the data file covers it, and only requests the rest. -S 0 syncs
+ * after every batch of packets; larger intervals are faster and lose more.
+ */
+#define	STATE_MAGIC	0x46425053
+
+struct state {
+	unsigned int magic;
+	pkt_count numPackets;
+	char checksum[40];
+	off_t size;         // end of the data durable covers
+	pkt_count prefix;   // packets hashed into sha
+	SHA_CTX sha;
+	bm_datatype durable[];
+};
+
+struct server {
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	time_t last;  // when we last heard its announcement, 0 if never
+	int waiting;  // its queue was empty then
+};
+
 struct transfer {
 	unsigned char fileid;
 	int fd;
-	pkt_count offset;
+	int dfd;                   // O_DIRECT descriptor we write through, -1 if we write through fd
+	char *state_path;          // where we keep the state to resume from, NULL if we don't
+	struct state *state;       // ... mapped
+	int unsynced;              // bitmask changed since we last synced the state
+	struct timeval sync_at;    // when we sync next, zero if nothing changed
+	long syncs;
+	pkt_count prefix;          // packets from the start that we hashed into sha, owned by the verifier
+	SHA_CTX sha;               // checksum of those, so far
+	unsigned char digest[SHA_DIGEST_LENGTH]; // of the whole file, once the verifier got that far
+	off_t size;                // end of the data we wrote so far
+	pkt_count numPackets;
+	pkt_count have;            // packets set in bitmask
+	char checksum[40];
 	struct timeval start;
+	struct server servers[FBP_MAX_SERVERS];
+	int numservers;
+	int route[FBP_MAX_SERVERS]; // server we ask for the shares of each, -1 for none this round
+	struct timeval request_at; // when our backoff ends, zero if no request is pending
+	int unicast;               // server unicasts repairs, so everyone has to ask for themselves
+	int done;                  // file is complete and verified
+	int open;                  // file is still growing, we don't know its checksum yet
+	struct timeval peers_until; // when we stop waiting for peers and ask the servers, zero if we're not
+	struct timeval repair_at;  // when we may send our next repair, zero if we have none queued
+	pkt_count repair_next;     // where we continue looking for repairs to send
+	long received;             // data packets received, also after we were done
+	long unneeded;             // ... of which we already had
+	long from_peers;           // data packets other receivers repaired for us
+	long repaired;             // data packets we repaired for other receivers
+	long zeroed;               // packets a zero map told us were all zero
+	long wire_bytes;           // data packet payload as it came in
+	long data_bytes;           // ... and as it was after decompression
+	int seed_fd;               // older version we copy unchanged blocks from, -1 if none
+	pkt_count seed_pages;      // hash pages of the file
+	pkt_count seed_left;       // ... that we still need
+	long seeded;               // packets we copied from it
+	struct Announcement announcement; // as we relay it
+	pkt_count relay_next;      // where we continue looking for packets to relay
+	pkt_count relay_waiting;   // packets in relay_wanted
+	pkt_count relay_queued;    // packets in relay_ready
+	long relayed;              // data packets we relayed
+	pkt_count front;           // furthest packet of the server's sweep we saw, -1 if none yet
+	pkt_count gap_first;       // no gaps before this one
+	struct timeval gap_at;     // when we NACK the gaps, zero if we have none waiting
+	struct timeval gap_sent;   // when we last did
+	long gap_nacked;           // packets we NACKed mid-sweep
+	long writes;               // pwrite()s of received data packets
+	long written;              // ... packets they wrote
+	struct extent *extents[WB_EXTENTS]; // NULL if unused
+	int pending;               // buffers of ours in the pipeline
 	BM_DEFINE(bitmask);
+	BM_DEFINE(inflight);       // packets in the pipeline
+	BM_DEFINE(ondisk);         // packets in the file, for the verifier
+	BM_DEFINE(heard);          // packets another receiver requested this round
+	BM_DEFINE(repair);         // packets peers asked for, that we have and nobody sent yet
+	BM_DEFINE(relay_wanted);   // packets the local receivers asked for, that we don't have yet
+	BM_DEFINE(relay_ready);    // packets the local receivers asked for, that we have
+	BM_DEFINE(hashed);         // hash pages we compared against the seed
+	BM_DEFINE(gaps);           // packets the sweep passed that we didn't get
+	BM_DEFINE(nacked);         // packets we or another receiver NACKed this round
 };
 
 int sfd;
 struct sockaddr_in addr;
 socklen_t addrlen;
+struct sockaddr_in group;
 struct transfer *transfers[(sizeof(unsigned char) * 256) - 1];
 
+// Maximum random delay before we send our requests; 0 disables suppression
+int backoff_usec = 20000;
+
+/*
+ * Peer repair: before asking the servers, we ask the other receivers for
+ * what we're missing. Whoever has it broadcasts it from its data file after
+ * a random delay, skipping what another peer or a server sent in the
+ * meantime, at no more than peer_pps packets per second. Once no repair
+ * came in for PEER_IDLE_USEC, we ask the servers for the rest. Repairs come
+ * from the receivers' port, which the servers never send from.
+ */
+#define	PEER_BACKOFF_USEC	10000
+#define	PEER_IDLE_USEC	50000
+#define	PEERS	FBP_MAX_SERVERS // request_from() target for asking the peers
+
+int peer_pps = 0;
+
+/*
+ * Relay mode: we serve every file we receive to another segment as well,
+ * like fbpd does, from the moment we start receiving it. Requests for
+ * packets we have are served at relay_pps, the rest as soon as they come in.
+ * Our own broadcasts come back to us from relay_port; we ignore those.
+ */
+#define	RELAY_ANNOUNCE_USEC	1000000
+
+int rfd = -1;
+struct sockaddr_in relay_group;
+in_port_t relay_port;
+int relay_pps = 10000;
+struct timeval relay_at, relay_announce_at;
+
+/*
+ * Delta transfer: with -s, we look for an older version of every file we
+ * receive in seed_dir. If the server publishes block hashes, we ask for
+ * those first, copy the blocks that didn't change from the older version,
+ * and only request the rest. The older version may be the file we're about
+ * to overwrite; we unlink that before creating the new one.
+ */
+char *seed_dir = NULL;
+
+/*
+ * Gap NACKs: while a server is still sweeping, we request the packets that
+ * are missing behind its sweep front right away, so it sends them again at
+ * the end of this sweep instead of after the next announcement. A gap waits
+ * GAP_HOLD_USEC and a random part of that again, as the layers reorder a
+ * little and another receiver may NACK it first; what another receiver did
+ * NACK, we leave out. We send at most GAP_NACK_PACKETS request packets every
+ * GAP_NACK_USEC. Only with one server and all of its layers do the packets
+ * come in order, so only then do we look for gaps; a jump of more than
+ * GAP_MAX_JUMP packets is the sweep moving on, not a loss.
+ */
+#define	GAP_HOLD_USEC	20000
+#define	GAP_NACK_USEC	10000
+#define	GAP_NACK_PACKETS	4
+#define	GAP_MAX_JUMP	256
+
+/*
+ * Endgame: once we miss no more than ENDGAME_PACKETS packets, we ask for them
+ * on every announcement, also while the server is still busy, and without
+ * backing off first, as holding back a handful of requests isn't worth the
+ * wait. fbpd -e sends rounds this small several times over.
+ */
+#define	ENDGAME_PACKETS	64
+#define	IN_ENDGAME(t)	(!(t)->open && ENDGAME_PACKETS >= (t)->numPackets - (t)->have)
+
+/*
+ * Direct imaging: with -o, we receive the first file announced straight into
+ * a block device or an existing file, instead of into data/, and ignore the
+ * others. Writes go through an O_DIRECT descriptor, from buffers aligned to
+ * DIRECT_ALIGN; a write-back window that isn't complete is merged with what
+ * is on disk first. Repairs and relaying read through a normal descriptor.
+ * Before verifying, we sync, and a regular file is cut to the exact length.
+ */
+#define	DIRECT_ALIGN	4096
+
+long sync_usec = 1000000;
+
+char *direct_path = NULL;
+int direct_fid = 0;
+char *direct_buf; // bounce buffer for merging a window with the disk
+
+/*
+ * Streaming: with -o -, we receive the first file announced into data/ as
+ * usual, and copy it to stdout as well, in order, as far as the verifier has
+ * hashed it; our messages go to stderr then. Packets past that wait in the
+ * write-back buffers, and once those are written out, in the data file, so
+ * a reader that falls behind costs no memory. The stream thread reads them
+ * back from there, mostly from the page cache, and a slow reader only holds
+ * up that thread. Every STREAM_URGE_USEC, we request the holes in the next
+ * STREAM_URGENT packets right away, even if the server is still busy, marked
+ * urgent so it sends them before the rest of its sweep, and again once the
+ * stream didn't move for STREAM_RETRY_USEC. With layers, that's only once
+ * we're on all of them, or holes are the packets of the others. The last
+ * packet goes out once the whole file checks out; if it doesn't, we streamed
+ * bad data and give up.
+ */
+#define	STREAM_URGENT	1024
+#define	STREAM_URGE_USEC	50000
+#define	STREAM_RETRY_USEC	250000
+
+int stream_fd = -1;          // stdout, -1 if we don't stream
+int stream_fid = 0;
+pthread_t streamer;
+off_t stream_avail = 0;      // bytes the stream thread may copy
+int stream_end = 0;          // ... and that's the whole file
+off_t streamed = 0;          // bytes it copied
+pkt_count stream_stalled = 0; // prefix when we last looked
+struct timeval stream_moved;  // ... when it last moved
+pkt_count stream_urged = 0;   // we asked for the holes before this one
+struct timeval stream_urge_at;
+
+/*
+ * Layered servers spread their data over several ports, each doubling the
+ * rate of the ones below it. We start out on the first one and join the next
+ * as long as we lose less than LAYER_JOIN_PERMILLE of the packets, and leave
+ * the highest one if we lose more than LAYER_DROP_PERMILLE. Every time we
+ * have to leave again, we wait twice as long before the next try.
+ */
+#define	LAYER_CHECK_USEC	500000
+#define	LAYER_MIN_SAMPLES	50
+#define	LAYER_JOIN_PERMILLE	10
+#define	LAYER_DROP_PERMILLE	50
+#define	LAYER_JOIN_USEC	1000000
+#define	LAYER_MAX_JOIN_USEC	32000000
+
+struct layer {
+	int fd;
+	int synced;         // next is valid
+	unsigned char next; // sequence number we expect next
+	long got, lost;     // since the last check
+} layers[FBP_MAX_LAYERS];
+
+int numlayers = 1;              // as announced
+int max_layers = FBP_MAX_LAYERS;
+int subscribed = 1;
+long join_usec = LAYER_JOIN_USEC;
+struct timeval next_join, next_check;
+
+/*
+ * Reception: a socket that is ready is drained with recvmmsg(), where we have
+ * it, RECV_BATCH datagrams per call straight into the free slots of rx_queue,
+ * for at most RECV_ROUNDS calls before we look at the other sockets again.
+ * With -g we also ask for UDP GRO, so the kernel may hand us a run of equally
+ * sized datagrams from one sender as one buffer, which we split up again.
+ * Without recvmmsg(), a batch is one recvfrom().
+ */
+#define	RECV_BATCH	64
+#define	RECV_ROUNDS	16
+#define	RECV_GRO_SIZE	65535
+#define	RECV_DGRAM_SIZE	MAX(sizeof(struct DataPacket), MAX(sizeof(struct Announcement), sizeof(struct NackNotice)))
+
+struct rxbuf {
+	char *data;
+	ssize_t len;
+	int segsize; // size of the datagrams GRO merged into data, 0 if it is one
+	int layer;   // it came in on
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	char control[64];
+} *rxbufs;     // the slots of rx_queue
+#ifdef MSG_WAITFORONE
+struct mmsghdr rxmsgs[RECV_BATCH];
+struct iovec rxiov[RECV_BATCH];
+#endif
+size_t rxsize = RECV_DGRAM_SIZE;
+int use_gro = 0;
+long rx_calls = 0;     // system calls that returned data
+long rx_buffers = 0;   // ... buffers they returned
+long rx_datagrams = 0; // ... datagrams in those
+long rx_most = 0;      // most datagrams one call returned
+
+/*
+ * Pipeline: a receive thread drains the sockets into rx_queue, so that a slow
+ * write or checksum doesn't leave datagrams to pile up in the kernel until it
+ * drops them. The main thread takes them from there and keeps all the
+ * protocol state. Every write-back buffer it is done with goes to the writer
+ * thread through write_queue, from the writer to the verifier through
+ * verify_queue once it is written, and back through done_queue once its
+ * packets are hashed into the checksum of the file so far. Only then does
+ * the main thread mark them received. Each queue is a lock-free ring with one
+ * producer and one consumer.
+ *
+ * Compressed data packets are decompressed on the receive thread as well,
+ * into the slots of unz_queue, one per such datagram in the order they are
+ * queued; the main thread gives each back once it handled that datagram.
+ *
+ * Backpressure is where the slots run out: the receive thread waits when
+ * rx_queue or unz_queue is full, leaving the datagrams to the socket buffer,
+ * and the main thread waits when all PIPELINE_BUFFERS write-back buffers are
+ * taken. All are counted, as is the deepest every queue got; SIGUSR1 prints
+ * them.
+ */
+#define	RX_QUEUE	4096
+#define	RX_QUEUE_GRO	256   // with GRO, slots are RECV_GRO_SIZE
+#define	PIPELINE_BUFFERS	64
+#define	QUEUE_FULL_USEC	100   // the receive thread sleeps this long when rx_queue is full
+#define	UNZ_QUEUE	256   // at least the datagrams one GRO buffer holds
+
+struct queue {
+	const char *name;
+	unsigned int size;    // slots, a power of two
+	unsigned int deepest; // most slots in use at once
+	long waits;           // times the producer found it full
+	unsigned int head __attribute__((aligned(64))); // next slot to fill, only the producer moves it
+	unsigned int tail __attribute__((aligned(64))); // next slot to take, only the consumer moves it
+};
+
+struct bell {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int rung;
+};
+
+struct queue rx_queue = { "receive", RX_QUEUE };
+struct queue write_queue = { "write", PIPELINE_BUFFERS };
+struct queue verify_queue = { "verify", PIPELINE_BUFFERS };
+struct queue done_queue = { "done", PIPELINE_BUFFERS };
+struct extent *write_slots[PIPELINE_BUFFERS], *verify_slots[PIPELINE_BUFFERS], *done_slots[PIPELINE_BUFFERS];
+#ifdef COMPRESSION
+struct queue unz_queue = { "decompress", UNZ_QUEUE };
+struct unzbuf {
+	size_t len; // what ZSTD_decompress() returned
+	char data[FBP_COMPRESS_GROUP * FBP_PACKET_DATASIZE];
+} *unzbufs;   // the slots of unz_queue
+#endif
+struct bell writer_bell = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+struct bell verifier_bell = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+struct bell stream_bell = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+int wakefd[2];        // the other threads wake the main thread through this pipe
+pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER; // held while the verifier hashes
+struct extent *buffers[PIPELINE_BUFFERS]; // free write-back buffers
+int free_buffers = 0;
+int in_pipeline = 0;   // buffers the other threads have
+long buffer_waits = 0; // times the main thread had to wait for one
+
+volatile sig_atomic_t quit = 0;
+volatile sig_atomic_t stats = 0;
+
+// Opens the device or file we image to for transfer t
+void
+direct_open(struct transfer *t, struct Announcement *apkt) {
+	off_t need = (off_t)apkt->numPackets * FBP_PACKET_DATASIZE, have;
+	struct stat st;
+
+	direct_fid = apkt->fileid;
+	if((t->fd = open(direct_path, O_RDWR)) == -1) {
+		err(1, "open(%s)", direct_path);
+	}
+	if(fstat(t->fd, &st) == -1) {
+		err(1, "fstat(%s)", direct_path);
+	}
+	if((have = lseek(t->fd, 0, SEEK_END)) == -1) {
+		err(1, "lseek(%s)", direct_path);
+	}
+	if(S_ISREG(st.st_mode) && need > have) {
+		if(ftruncate(t->fd, need) == -1) {
+			err(1, "ftruncate(%s)", direct_path);
+		}
+	} else if(!S_ISREG(st.st_mode) && need > have) {
+		errx(1, "%s holds %lld bytes, %s needs up to %lld", direct_path, (long long)have, apkt->filename, (long long)need);
+	}
+#ifdef O_DIRECT
+	if((t->dfd = open(direct_path, O_RDWR | O_DIRECT)) == -1) {
+		warn("open(%s, O_DIRECT), writing through the page cache", direct_path);
+	}
+#endif
+	if(t->dfd != -1 && direct_buf == NULL && posix_memalign((void **)&direct_buf, DIRECT_ALIGN, WB_PACKETS * FBP_PACKET_DATASIZE) != 0) {
+		err(1, "posix_memalign() (bounce buffer)");
+	}
+	printf("direct_open(): [%d] Writing %s to %s%s\n", apkt->fileid, apkt->filename, direct_path, (t->dfd != -1) ? " with O_DIRECT" : "");
+}
+
+/*
+ * Maps the state of t, and starts it over unless it is for this very file.
+ * Returns whether it says we have some packets already.
+ */
+int
+resume_open(struct transfer *t, struct Announcement *apkt) {
+	size_t size = sizeof(struct state) + BM_SIZE(apkt->numPackets);
+	struct stat st;
+	int fd, fresh;
+	pkt_count n, have = 0;
+
+	if(direct_path != NULL && stat(direct_path, &st) == 0 && S_ISREG(st.st_mode)) {
+		asprintf(&t->state_path, "%s.fbpstate", direct_path);
+	} else {
+		asprintf(&t->state_path, "data/%s.fbpstate", apkt->filename);
+	}
+	if((fd = open(t->state_path, O_RDWR | O_CREAT, 0644)) == -1) {
+		err(1, "open(%s)", t->state_path);
+	}
+	if(fstat(fd, &st) == -1) {
+		err(1, "fstat(%s)", t->state_path);
+	}
+	fresh = (st.st_size != size);
+	if(fresh && (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)) {
+		err(1, "ftruncate(%s)", t->state_path);
+	}
+	if((t->state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		err(1, "mmap(%s)", t->state_path);
+	}
+	close(fd);
+	if(!fresh && t->state->magic == STATE_MAGIC && t->state->numPackets == apkt->numPackets
+	 && memcmp(t->state->checksum, apkt->checksum, sizeof(t->state->checksum)) == 0) {
+		for(n = 0; apkt->numPackets > n; n++) {
+			if(BM_ISSET(t->state->durable, n)) {
+				have++;
+			}
+		}
+		if(have > 0) {
+			return 1;
+		}
+	}
+	memset(t->state, 0, size);
+	t->state->magic = STATE_MAGIC;
+	t->state->numPackets = apkt->numPackets;
+	memcpy(t->state->checksum, apkt->checksum, sizeof(t->state->checksum));
+	if(msync(t->state, size, MS_SYNC) == -1) {
+		err(1, "msync(%s)", t->state_path);
+	}
+	return 0;
+}
+
+/*
+ * Takes over the packets the state of t says we have, if the data file still
+ * holds as much as the state recorded when it last synced. Checking it against
+ * the last packet proves nothing, as reserve_file() made it that long up front.
+ * An image written to a device always holds it.
+ */
+void
+resume_load(struct transfer *t) {
+	pkt_count n, have = 0;
+	struct stat st;
+
+	for(n = 0; t->numPackets > n; n++) {
+		if(BM_ISSET(t->state->durable, n)) {
+			have++;
+		}
+	}
+	if(fstat(t->fd, &st) == -1) {
+		err(1, "fstat");
+	}
+	if(S_ISREG(st.st_mode) && st.st_size < t->state->size) {
+		printf("resume_load(): [%d] Data file is shorter than %s says, starting over\n", t->fileid, t->state_path);
+		memset(t->state->durable, 0, BM_SIZE(t->numPackets));
+		t->unsynced = 1;
+		return;
+	}
+	memcpy(t->bitmask, t->state->durable, BM_SIZE(t->numPackets));
+	t->have = have;
+	memcpy(t->ondisk, t->state->durable, BM_SIZE(t->numPackets));
+	t->size = t->state->size;
+	t->prefix = t->state->prefix;
+	t->sha = t->state->sha;
+	printf("resume_load(): [%d] Resuming with %d of %d packets\n", t->fileid, have, t->numPackets);
+}
+
+// Syncs the data file of t, and then records what is in it in the state
+void
+resume_sync(struct transfer *t) {
+	int i;
+
+	if(t->state == NULL || !t->unsynced) {
+		return;
+	}
+	if(fdatasync(t->fd) == -1) {
+		err(1, "fdatasync");
+	}
+	for(i = 0; BM_UNITS(t->numPackets) > i; i++) {
+		// only dirty the pages that changed
+		if(t->state->durable[i] != t->bitmask[i]) {
+			t->state->durable[i] = t->bitmask[i];
+		}
+	}
+	t->state->size = t->size;
+	pthread_mutex_lock(&verify_lock);
+	t->state->prefix = t->prefix;
+	t->state->sha = t->sha;
+	pthread_mutex_unlock(&verify_lock);
+	if(msync(t->state, sizeof(struct state) + BM_SIZE(t->numPackets), MS_SYNC) == -1) {
+		err(1, "msync(%s)", t->state_path);
+	}
+	t->unsynced = 0;
+	t->syncs++;
+	TIMEVAL_CLEAR(t->sync_at);
+}
+
+// Removes the state of t, now that it is complete
+void
+resume_done(struct transfer *t) {
+	if(t->state == NULL) {
+		return;
+	}
+	munmap(t->state, sizeof(struct state) + BM_SIZE(t->numPackets));
+	t->state = NULL;
+	if(unlink(t->state_path) == -1) {
+		warn("unlink(%s)", t->state_path);
+	}
+}
+
+/*
+ * Reserves the data file of t up to its last packet, so the packets that come
+ * in out of order are written into space that is already there, in one piece,
+ * instead of extending and fragmenting the file as they go. Writing the last
+ * packet sets the exact length. Packets a zero map covers are punched out
+ * again, so they still end up as holes.
+ */
+void
+reserve_file(struct transfer *t) {
+	off_t size = (off_t)(t->numPackets - 1) * FBP_PACKET_DATASIZE;
+	struct stat st;
+
+	if(fstat(t->fd, &st) == -1) {
+		err(1, "fstat");
+	}
+	if(st.st_size >= size) {
+		return;
+	}
+#ifdef __linux__
+	if(fallocate(t->fd, 0, 0, size) == 0) {
+		return;
+	}
+	if(errno != EOPNOTSUPP && errno != ENOSYS) {
+		err(1, "fallocate");
+	}
+#endif
+	// at least the file system won't have to extend it
+	if(ftruncate(t->fd, size) == -1) {
+		err(1, "ftruncate");
+	}
+}
+
+// Turns packets first up to end of t back into a hole, now that we know they're all zero
 void
-start_transfer(struct Announcement *apkt, struct sockaddr_in *raddr, socklen_t raddrlen) {
+punch_zeros(struct transfer *t, pkt_count first, pkt_count end) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if(fallocate(t->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first * FBP_PACKET_DATASIZE, (off_t)(end - first) * FBP_PACKET_DATASIZE) == -1
+	 && errno != EOPNOTSUPP && errno != ENOSYS) {
+		err(1, "fallocate(FALLOC_FL_PUNCH_HOLE)");
+	}
+#endif
+}
+
+void
+start_transfer(struct Announcement *apkt) {
 	assert(transfers[apkt->fileid] == NULL);
 
 	struct transfer *t = calloc(1, sizeof(struct transfer));
 	transfers[apkt->fileid] = t;
 
 	char *fname;
-	asprintf(&fname, "data/%s", apkt->filename);
-	t->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
-	free(fname);
-	if(t->fd == -1) {
-		err(1, "open");
+	int resumed = 0;
+	if(!(apkt->flags & FBP_FLAG_OPEN) && apkt->numPackets > 0) {
+		resumed = resume_open(t, apkt);
+	}
+	t->seed_fd = -1;
+	if(!resumed && seed_dir != NULL && (apkt->flags & FBP_FLAG_HASHES) && !(apkt->flags & FBP_FLAG_OPEN) && apkt->numPackets > 0) {
+		asprintf(&fname, "%s/%s", seed_dir, apkt->filename);
+		if((t->seed_fd = open(fname, O_RDONLY)) != -1) {
+			printf("start_transfer(): [%d] Seeding from %s\n", apkt->fileid, fname);
+			t->seed_pages = ((apkt->numPackets + FBP_HASH_BLOCK - 1) / FBP_HASH_BLOCK + FBP_HASHES_PER_PAGE - 1) / FBP_HASHES_PER_PAGE;
+			t->seed_left = t->seed_pages;
+			BM_INIT(t->hashed, t->seed_pages);
+		}
+		free(fname);
+	}
+	t->dfd = -1;
+	if(direct_path != NULL) {
+		direct_open(t, apkt);
+	} else {
+		asprintf(&fname, "data/%s", apkt->filename);
+		if(t->seed_fd != -1) {
+			// the seed may be this very file
+			unlink(fname);
+		}
+		t->fd = open(fname, O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+		free(fname);
+		if(t->fd == -1) {
+			err(1, "open");
+		}
 	}
 	t->fileid = apkt->fileid;
-	t->offset = 0;
+	if(stream_fd != -1) {
+		stream_fid = apkt->fileid;
+		printf("start_transfer(): [%d] Streaming %s to stdout\n", apkt->fileid, apkt->filename);
+	}
+	if(SHA1_Init(&t->sha) == 0) {
+		errno = 0;
+		err(1, "SHA1_Init() failed; possible cause");
+	}
+	t->numPackets = apkt->numPackets;
+	memcpy(t->checksum, apkt->checksum, sizeof(t->checksum));
+	t->open = ((apkt->flags & FBP_FLAG_OPEN) != 0);
+	t->numservers = MAX(1, apkt->serverCount);
 	BM_INIT(t->bitmask, apkt->numPackets);
+	BM_INIT(t->heard, apkt->numPackets);
+	BM_INIT(t->repair, apkt->numPackets);
+	BM_INIT(t->inflight, apkt->numPackets);
+	BM_INIT(t->ondisk, apkt->numPackets);
+	BM_INIT(t->gaps, apkt->numPackets);
+	BM_INIT(t->nacked, apkt->numPackets);
+	t->front = -1;
+	if(resumed) {
+		resume_load(t);
+	}
+	if(direct_path == NULL && !t->open && t->numPackets > 1) {
+		reserve_file(t);
+	}
+	if(rfd != -1) {
+		memcpy(&t->announcement, apkt, sizeof(t->announcement));
+		t->announcement.flags = apkt->flags & FBP_FLAG_OPEN;
+		t->announcement.numLayers = 1;
+		t->announcement.serverIndex = 0;
+		t->announcement.serverCount = 1;
+		BM_INIT(t->relay_wanted, apkt->numPackets);
+		BM_INIT(t->relay_ready, apkt->numPackets);
+		TIMEVAL_CLEAR(relay_announce_at);
+	}
 	gettimeofday(&t->start, NULL);
 }
 
+// Marks packet n as received, and queues it if a local receiver asked us to relay it
+static void
+mark_received(struct transfer *t, pkt_count n) {
+	BM_SET(t->bitmask, n);
+	t->have++;
+	t->unsynced = 1;
+	if(rfd != -1 && BM_ISSET(t->relay_wanted, n)) {
+		BM_CLR(t->relay_wanted, n);
+		BM_SET(t->relay_ready, n);
+		t->relay_waiting--;
+		t->relay_queued++;
+	}
+}
+
+// Shortens *wait so we wake up at *at, unless that's zero
 void
-handle_announcement(struct Announcement *apkt, ssize_t pktlen, struct sockaddr_in *raddr, socklen_t raddrlen) {
-	if(apkt->announceVer > FBP_ANNOUNCE_VERSION) {
-		printf("handle_announcement(): Dropping too high version\n");
+wait_until(long *wait, struct timeval *at, struct timeval *now) {
+	long usec;
+	if(TIMEVAL_IS_ZERO(*at)) {
 		return;
 	}
-	if(transfers[apkt->fileid] == NULL) {
-		printf("handle_announcement(): Unknown file-id %d; starting transfer\n", apkt->fileid);
-		start_transfer(apkt, raddr, raddrlen);
+	usec = MAX(0, TIMEVAL_SUBSTRACT(*at, *now));
+	if(*wait == -1 || usec < *wait) {
+		*wait = usec;
 	}
-	struct transfer *t = transfers[apkt->fileid];
-	if(t->fd == -1) {
-		return;
+}
+
+// Returns how many slots the producer may fill from q->head on
+static inline unsigned int
+queue_space(struct queue *q) {
+	return q->size - (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE));
+}
+
+// Hands the next n slots to the consumer
+static inline void
+queue_push(struct queue *q, unsigned int n) {
+	unsigned int depth = q->head + n - __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	if(depth > q->deepest) {
+		q->deepest = depth;
 	}
-	if(apkt->status == FBP_STATUS_TRANSFERRING) {
-		printf("handle_announcement(): [%d] Transfer is running; I can wait\n", apkt->fileid);
-		return;
+	__atomic_store_n(&q->head, q->head + n, __ATOMIC_RELEASE);
+}
+
+// Returns how many slots the consumer may take from q->tail on
+static inline unsigned int
+queue_depth(struct queue *q) {
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - q->tail;
+}
+
+// Gives the first n slots back to the producer
+static inline void
+queue_pop(struct queue *q, unsigned int n) {
+	__atomic_store_n(&q->tail, q->tail + n, __ATOMIC_RELEASE);
+}
+
+void
+bell_ring(struct bell *b) {
+	pthread_mutex_lock(&b->lock);
+	b->rung = 1;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+// Waits until the bell was rung since we last waited for it
+void
+bell_wait(struct bell *b) {
+	pthread_mutex_lock(&b->lock);
+	while(!b->rung) {
+		pthread_cond_wait(&b->cond, &b->lock);
 	}
+	b->rung = 0;
+	pthread_mutex_unlock(&b->lock);
+}
 
-	pkt_count n;
-	struct RequestPacket rpkt;
-	bzero(&rpkt, sizeof(rpkt));
-	int done = 1;
+// Wakes up the main thread; if the pipe is full, it has plenty of wakeups pending
+void
+wake_main() {
+	if(write(wakefd[1], "", 1) == -1 && errno != EAGAIN) {
+		err(1, "write");
+	}
+}
 
-	rpkt.fileid = t->fileid;
-	int rid = 0;
-	rpkt.requests[rid].offset = 0;
-	rpkt.requests[rid].num = 0;
-	for(n = 0; apkt->numPackets > n; n++) {
-		if(!BM_ISSET(t->bitmask, n)) {
-			if(rpkt.requests[rid].num == 0) {
-				rpkt.requests[rid].offset = n;
-			}
-			rpkt.requests[rid].num++;
-		} else if(rpkt.requests[rid].num > 0) {
-			printf("handle_announcement(): [%d] Requesting %d packets from offset %d (in rid %d)\n", apkt->fileid, rpkt.requests[rid].num, rpkt.requests[rid].offset, rid);
-			if(rid < FBP_REQUESTS_PER_PACKET - 1) {
-				rid++;
-			} else {
-				done = 0;
-				if(sendto(sfd, &rpkt, sizeof(rpkt), 0, (struct sockaddr *)raddr, raddrlen) == -1) {
-					err(1, "sendto");
-				}
-				for(rid = 0; FBP_REQUESTS_PER_PACKET > rid; rid++) {
-					rpkt.requests[rid].offset = 0;
-					rpkt.requests[rid].num = 0;
+/*
+ * Takes back the buffers the pipeline is done with, and marks their packets
+ * received.
+ */
+void
+pipeline_poll() {
+	struct extent *e;
+	struct transfer *t;
+	pkt_count i;
+
+	while(queue_depth(&done_queue) > 0) {
+		e = done_slots[done_queue.tail % done_queue.size];
+		queue_pop(&done_queue, 1);
+		t = e->t;
+		t->pending--;
+		in_pipeline--;
+		for(i = 0; !e->finish && WB_PACKETS > i; i++) {
+			if(BM_ISSET(e->have, i)) {
+				BM_CLR(t->inflight, e->first + i);
+				if(!BM_ISSET(t->bitmask, e->first + i)) {
+					// a zero map may have beaten it
+					mark_received(t, e->first + i);
 				}
-				rid = 0;
 			}
 		}
+		if(!e->finish) {
+			t->size = MAX(t->size, e->end);
+			t->writes += e->writes;
+			t->written += e->count;
+		}
+		e->first = -1;
+		e->count = 0;
+		e->finish = 0;
+		memset(e->have, 0, sizeof(e->have));
+		buffers[free_buffers++] = e;
 	}
-	if(rpkt.requests[rid].num > 0) {
-		printf("handle_announcement(): [%d] Requesting %d packets from offset %d\n", apkt->fileid, rpkt.requests[rid].num, rpkt.requests[rid].offset);
-		rid++;
+}
+
+// Waits for the pipeline to hand something back, and takes it
+void
+pipeline_wait() {
+	struct pollfd pfd;
+	char buf[256];
+
+	pfd.fd = wakefd[0];
+	pfd.events = POLLIN;
+	while(queue_depth(&done_queue) == 0) {
+		if(poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			err(1, "poll");
+		}
+		while(read(wakefd[0], buf, sizeof(buf)) > 0);
 	}
-	if(rid > 0) {
-		done = 0;
-		if(sendto(sfd, &rpkt, sizeof(rpkt), 0, (struct sockaddr *)raddr, raddrlen) == -1) {
-			err(1, "sendto");
+	pipeline_poll();
+}
+
+// Returns a free write-back buffer, waiting for one if we have to
+struct extent *
+pipeline_get() {
+	if(free_buffers == 0) {
+		buffer_waits++;
+		while(free_buffers == 0) {
+			pipeline_wait();
 		}
 	}
+	return buffers[--free_buffers];
+}
 
-	if(done) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		now.tv_sec -= t->start.tv_sec;
-		now.tv_usec -= t->start.tv_usec;
-		if(now.tv_usec < 0) {
-			now.tv_usec += 1000000;
-			now.tv_sec++;
-		}
-		printf("handle_announcement(): [%d] Ready in %ld.%ld seconds\n", apkt->fileid, now.tv_sec, now.tv_usec);
-		char checksum[sizeof(apkt->checksum)];
-		sha1_file(checksum, t->fd);
-		if(strncmp(apkt->checksum, checksum, sizeof(checksum)) != 0) {
-			int n;
-			printf("handle_announcement(): [%d] Checksum mismatch: %.*s != %.*s. Restarting transfer.\n", apkt->fileid, sizeof(checksum), apkt->checksum, sizeof(checksum), checksum);
-			for(n = 0; apkt->numPackets > n; n++) {
-				BM_CLR(t->bitmask, n);
+// Hands extent e to the writer thread
+void
+pipeline_send(struct transfer *t, struct extent *e) {
+	e->t = t;
+	t->pending++;
+	in_pipeline++;
+	write_slots[write_queue.head % write_queue.size] = e;
+	queue_push(&write_queue, 1);
+	bell_ring(&writer_bell);
+}
+
+// Waits until the pipeline is done with everything of t
+void
+pipeline_drain(struct transfer *t) {
+	while(t->pending > 0) {
+		pipeline_wait();
+	}
+}
+
+/*
+ * Writes out what we have of extent e through the O_DIRECT descriptor, as one
+ * aligned write from the first packet we have to the last. Unless we have all
+ * of that, we read it from the disk first and put our packets over it.
+ */
+void
+wb_flush_direct(struct transfer *t, struct extent *e) {
+	pkt_count i, lo = -1, hi = 0;
+	off_t start, end, base = (off_t)e->first * FBP_PACKET_DATASIZE;
+	char *buf = e->data;
+	ssize_t len;
+
+	for(i = 0; WB_PACKETS > i; i++) {
+		if(BM_ISSET(e->have, i)) {
+			lo = (lo == -1) ? i : lo;
+			hi = i;
+		}
+	}
+	end = (off_t)hi * FBP_PACKET_DATASIZE + e->size[hi];
+	e->end = base + end;
+	start = (off_t)lo * FBP_PACKET_DATASIZE / DIRECT_ALIGN * DIRECT_ALIGN;
+	end = ROUNDUP(end, DIRECT_ALIGN);
+	if(e->count != hi - lo + 1 || start != (off_t)lo * FBP_PACKET_DATASIZE || end != (off_t)hi * FBP_PACKET_DATASIZE + e->size[hi]) {
+		buf = direct_buf;
+		if((len = pread(t->dfd, buf + start, end - start, base + start)) == -1) {
+			err(1, "pread(%s)", direct_path);
+		}
+		// past the end of a file
+		memset(buf + start + len, 0, end - start - len);
+		for(i = lo; hi >= i; i++) {
+			if(BM_ISSET(e->have, i)) {
+				memcpy(buf + (off_t)i * FBP_PACKET_DATASIZE, &e->data[i * FBP_PACKET_DATASIZE], e->size[i]);
 			}
-		} else {
-			close(t->fd);
-			t->fd = -1;
 		}
 	}
+	if(pwrite(t->dfd, buf + start, end - start, base + start) != end - start) {
+		err(1, "pwrite(%s)", direct_path);
+	}
+	e->writes++;
 }
 
+// Writes out what we have of extent e, on the writer thread
 void
-handle_datapacket(struct DataPacket *dpkt, ssize_t pktlen) {
-	if(transfers[dpkt->fileid] == NULL) {
-		// XXX bufferen ?
-		return;
+wb_writeout(struct transfer *t, struct extent *e) {
+	pkt_count i, j;
+	size_t len;
+
+	e->end = 0;
+	e->writes = 0;
+	if(t->dfd != -1) {
+		wb_flush_direct(t, e);
+		goto written;
 	}
-	struct transfer *t = transfers[dpkt->fileid];
-	if(t->fd == -1) {
-		// transfer is complete
-		return;
+	for(i = 0; WB_PACKETS > i; i = j) {
+		if(!BM_ISSET(e->have, i)) {
+			j = i + 1;
+			continue;
+		}
+		len = 0;
+		for(j = i; WB_PACKETS > j && BM_ISSET(e->have, j); j++) {
+			len += e->size[j];
+			if(e->size[j] != FBP_PACKET_DATASIZE) {
+				// only the last packet of a file is short
+				j++;
+				break;
+			}
+		}
+		if(pwrite(t->fd, &e->data[i * FBP_PACKET_DATASIZE], len, (off_t)(e->first + i) * FBP_PACKET_DATASIZE) != len) {
+			err(1, "pwrite");
+		}
+		e->writes++;
+		e->end = MAX(e->end, (off_t)(e->first + i) * FBP_PACKET_DATASIZE + len);
 	}
-	if(t->offset != dpkt->offset) {
-		if(lseek(t->fd, dpkt->offset * FBP_PACKET_DATASIZE, SEEK_SET) == -1) {
-			err(1, "lseek");
+written:
+	for(i = 0; WB_PACKETS > i; i++) {
+		if(BM_ISSET(e->have, i)) {
+			BM_SET_ATOMIC(t->ondisk, e->first + i);
 		}
 	}
-	if(write(t->fd, dpkt->data, MIN(FBP_PACKET_DATASIZE, FBP_PACKET_DATASIZE - sizeof(struct DataPacket) + pktlen)) == -1) {
-		err(1, "write");
+}
+
+/*
+ * Hashes the packets in the file from t->prefix on, as far as they're
+ * contiguous, so that verifying the file at the end only has to hash what's
+ * left. Those in extent e are taken from its buffer, the others are read
+ * back, mostly from the page cache. A packet in the file but past its end is
+ * one a zero map told us about. The last packet waits for e->finish, when we
+ * know how long it is; the main thread then waits for us.
+ */
+void
+prefix_advance(struct transfer *t, struct extent *e) {
+	char buf[WB_PACKETS * FBP_PACKET_DATASIZE];
+	pkt_count n, end, last = e->finish ? t->numPackets : t->numPackets - 1;
+	ssize_t len, want;
+
+	while(last > t->prefix && BM_ISSET_ATOMIC(t->ondisk, t->prefix)) {
+		n = t->prefix;
+		if(e->first == n - n % WB_PACKETS && BM_ISSET(e->have, n - e->first)) {
+			for(len = 0, end = n; e->first + WB_PACKETS > end && last > end && BM_ISSET(e->have, end - e->first); end++) {
+				len += e->size[end - e->first];
+			}
+			if(SHA1_Update(&t->sha, &e->data[(n - e->first) * FBP_PACKET_DATASIZE], len) == 0) {
+				errno = 0;
+				err(1, "SHA1_Update() failed; possible cause");
+			}
+			t->prefix = end;
+			continue;
+		}
+		for(end = n; n + WB_PACKETS > end && last > end && BM_ISSET_ATOMIC(t->ondisk, end); end++);
+		want = (off_t)(end - n) * FBP_PACKET_DATASIZE;
+		if(end == t->numPackets) {
+			// the last packet is as long as what we wrote of it
+			want = MIN(want, t->size - (off_t)n * FBP_PACKET_DATASIZE);
+		}
+		if((len = pread(t->fd, buf, want, (off_t)n * FBP_PACKET_DATASIZE)) == -1) {
+			err(1, "pread");
+		}
+		memset(buf + len, 0, want - len);
+		if(SHA1_Update(&t->sha, buf, want) == 0) {
+			errno = 0;
+			err(1, "SHA1_Update() failed; possible cause");
+		}
+		t->prefix = end;
+	}
+	if(e->finish && t->prefix == t->numPackets && SHA1_Final(t->digest, &t->sha) == 0) {
+		errno = 0;
+		err(1, "SHA1_Final() failed; possible cause");
 	}
-	t->offset = dpkt->offset+1;
-	BM_SET(t->bitmask, dpkt->offset);
 }
 
-int
-main(int argc, char **argv) {
-	assert((1 >> 1) == 0 /* require little endian */);
+void *
+writer_thread(void *arg) {
+	struct extent *e;
 
-	bzero(&transfers, sizeof(transfers));
+	while(1) {
+		while(queue_depth(&write_queue) == 0) {
+			bell_wait(&writer_bell);
+		}
+		e = write_slots[write_queue.tail % write_queue.size];
+		queue_pop(&write_queue, 1);
+		if(!e->finish) {
+			wb_writeout(e->t, e);
+		}
+		verify_slots[verify_queue.head % verify_queue.size] = e;
+		queue_push(&verify_queue, 1);
+		bell_ring(&verifier_bell);
+	}
+	return NULL;
+}
 
-	bzero(&addr, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(FBP_DEFAULT_PORT);
-	addrlen = sizeof(addr);
+// Lets the stream thread copy the first avail bytes, and all of them if end
+void
+stream_offer(off_t avail, int end) {
+	off_t old = __atomic_load_n(&stream_avail, __ATOMIC_RELAXED);
 
-	if((sfd = socket(addr.sin_family, SOCK_DGRAM, 0)) == -1) {
-		err(1, "socket");
+	// the verifier and the main thread both offer, only ever more
+	while(avail > old && !__atomic_compare_exchange_n(&stream_avail, &old, avail, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if(end) {
+		__atomic_store_n(&stream_end, 1, __ATOMIC_RELEASE);
 	}
+	bell_ring(&stream_bell);
+}
 
-	if(bind(sfd, (struct sockaddr *)&addr, addrlen) == -1) {
-		err(1, "bind");
+void *
+verifier_thread(void *arg) {
+	struct extent *e;
+
+	while(1) {
+		while(queue_depth(&verify_queue) == 0) {
+			bell_wait(&verifier_bell);
+		}
+		e = verify_slots[verify_queue.tail % verify_queue.size];
+		queue_pop(&verify_queue, 1);
+		pthread_mutex_lock(&verify_lock);
+		prefix_advance(e->t, e);
+		pthread_mutex_unlock(&verify_lock);
+		if(e->t->fileid == stream_fid) {
+			// all but the last packet are whole ones
+			stream_offer((off_t)MIN(e->t->prefix, e->t->numPackets - 1) * FBP_PACKET_DATASIZE, 0);
+		}
+		done_slots[done_queue.head % done_queue.size] = e;
+		queue_push(&done_queue, 1);
+		wake_main();
 	}
+	return NULL;
+}
+
+/*
+ * Copies the streamed file to stdout as far as it may, and closes stdout
+ * once it copied all of it
+ */
+void *
+stream_thread(void *arg) {
+	struct transfer *t;
+	char buf[WB_PACKETS * FBP_PACKET_DATASIZE];
+	off_t avail;
+	ssize_t len, want, done;
+	int end;
 
 	while(1) {
-		struct sockaddr_in raddr;
-		socklen_t raddrlen = sizeof(raddr);
-		ssize_t len;
-		char buf[MAX(sizeof(struct DataPacket), sizeof(struct Announcement))];
+		// stream_end goes up after stream_avail
+		end = __atomic_load_n(&stream_end, __ATOMIC_ACQUIRE);
+		if((avail = __atomic_load_n(&stream_avail, __ATOMIC_ACQUIRE)) == streamed && end) {
+			break;
+		}
+		if(avail == streamed) {
+			bell_wait(&stream_bell);
+			continue;
+		}
+		// only offered once the transfer started
+		t = transfers[stream_fid];
+		want = MIN(sizeof(buf), avail - streamed);
+		if((len = pread(t->fd, buf, want, streamed)) == -1) {
+			err(1, "pread");
+		}
+		// holes past the end of what we wrote so far
+		memset(buf + len, 0, want - len);
+		for(done = 0; want > done; done += len) {
+			if((len = write(stream_fd, buf + done, want - done)) == -1) {
+				err(1, "write(stdout)");
+			}
+		}
+		__atomic_store_n(&streamed, streamed + want, __ATOMIC_RELEASE);
+	}
+	if(close(stream_fd) == -1) {
+		err(1, "close(stdout)");
+	}
+	printf("stream_thread(): [%d] Streamed %lld bytes\n", stream_fid, (long long)streamed);
+	return NULL;
+}
 
-		len = recvfrom(sfd, buf, sizeof(buf), 0, (struct sockaddr *)&raddr, &raddrlen);
+// Hands extent slot of t to the writer
+void
+wb_flush(struct transfer *t, int slot) {
+	struct extent *e = t->extents[slot];
+	pkt_count i;
 
-		if(buf[0] == 0) {
-			handle_announcement((struct Announcement *)buf, len, &raddr, raddrlen);
-		} else {
-			handle_datapacket((struct DataPacket *)buf, len);
+	if(e == NULL) {
+		return;
+	}
+	for(i = 0; WB_PACKETS > i; i++) {
+		if(BM_ISSET(e->have, i)) {
+			BM_SET(t->inflight, e->first + i);
+		}
+	}
+	t->extents[slot] = NULL;
+	pipeline_send(t, e);
+}
+
+// Writes out everything we have of t, and waits until it is marked received
+void
+wb_flush_all(struct transfer *t) {
+	int i;
+	for(i = 0; WB_EXTENTS > i; i++) {
+		wb_flush(t, i);
+	}
+	pipeline_drain(t);
+}
+
+// Returns whether we have packet n, written out or not
+static int
+wb_have(struct transfer *t, pkt_count n) {
+	int i;
+	if(BM_ISSET(t->bitmask, n) || BM_ISSET(t->inflight, n)) {
+		return 1;
+	}
+	for(i = 0; WB_EXTENTS > i; i++) {
+		if(t->extents[i] != NULL && t->extents[i]->first == n - n % WB_PACKETS) {
+			return BM_ISSET(t->extents[i]->have, n % WB_PACKETS);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Writes out the extent nothing came in for the longest, when every buffer
+ * is waiting to be filled up and none will come back from the pipeline
+ */
+void
+wb_flush_coldest() {
+	struct transfer *ct = NULL;
+	int i, j, slot = 0;
+
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		for(j = 0; transfers[i] != NULL && WB_EXTENTS > j; j++) {
+			struct extent *e = transfers[i]->extents[j];
+			if(e != NULL && (ct == NULL || IS_PAST(ct->extents[slot]->touched, e->touched))) {
+				ct = transfers[i];
+				slot = j;
+			}
+		}
+	}
+	wb_flush(ct, slot);
+}
+
+// Buffers packet n, writing out the window it displaces, or its own once it's complete
+void
+wb_write(struct transfer *t, pkt_count n, const char *data, size_t len) {
+	pkt_count first = n - n % WB_PACKETS;
+	struct extent *e;
+	int i, slot = -1;
+
+	for(i = 0; WB_EXTENTS > i; i++) {
+		e = t->extents[i];
+		if(e != NULL && e->first == first) {
+			slot = i;
+			break;
+		}
+		if(slot == -1 || (t->extents[slot] != NULL && (e == NULL || IS_PAST(t->extents[slot]->touched, e->touched)))) {
+			slot = i;
+		}
+	}
+	if(t->extents[slot] == NULL || t->extents[slot]->first != first) {
+		wb_flush(t, slot);
+		if(free_buffers == 0 && in_pipeline == 0) {
+			wb_flush_coldest();
+		}
+		t->extents[slot] = pipeline_get();
+		t->extents[slot]->first = first;
+	}
+	e = t->extents[slot];
+	if(!BM_ISSET(e->have, n - first)) {
+		BM_SET(e->have, n - first);
+		e->count++;
+	}
+	memcpy(&e->data[(n - first) * FBP_PACKET_DATASIZE], data, len);
+	e->size[n - first] = len;
+	gettimeofday(&e->touched, NULL);
+	if(e->count == MIN(WB_PACKETS, t->numPackets - first)) {
+		wb_flush(t, slot);
+	}
+}
+
+// Writes out the extents nothing came in for lately, and shortens *wait to when the next one goes cold
+void
+wb_flush_cold(long *wait, struct timeval *now) {
+	struct timeval cold;
+	int i, j;
+
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		if(transfers[i] == NULL) {
+			continue;
+		}
+		for(j = 0; WB_EXTENTS > j; j++) {
+			struct extent *e = transfers[i]->extents[j];
+			if(e == NULL) {
+				continue;
+			}
+			cold = e->touched;
+			TIMEVAL_ADD_USEC(cold, WB_COLD_USEC);
+			if(!IS_PAST(cold, *now)) {
+				wb_flush(transfers[i], j);
+			} else {
+				wait_until(wait, &cold, now);
+			}
+		}
+	}
+}
+
+// Makes room for the packets a streamed file grew by
+void
+grow_transfer(struct transfer *t, pkt_count numPackets) {
+	printf("grow_transfer(): [%d] File grew from %d to %d packets\n", t->fileid, t->numPackets, numPackets);
+	// the writer and the verifier use the bitmasks too
+	pipeline_drain(t);
+	BM_GROW(t->bitmask, t->numPackets, numPackets);
+	BM_GROW(t->inflight, t->numPackets, numPackets);
+	BM_GROW(t->ondisk, t->numPackets, numPackets);
+	BM_GROW(t->gaps, t->numPackets, numPackets);
+	BM_GROW(t->nacked, t->numPackets, numPackets);
+	BM_GROW(t->heard, t->numPackets, numPackets);
+	BM_GROW(t->repair, t->numPackets, numPackets);
+	if(rfd != -1) {
+		BM_GROW(t->relay_wanted, t->numPackets, numPackets);
+		BM_GROW(t->relay_ready, t->numPackets, numPackets);
+		t->announcement.numPackets = numPackets;
+	}
+	t->numPackets = numPackets;
+}
+
+// Syncs the state of the transfers that changed sync_usec ago, and shortens *wait to the next one
+void
+resume_sync_due(long *wait, struct timeval *now) {
+	int i;
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		struct transfer *t = transfers[i];
+		if(t == NULL || t->state == NULL || !t->unsynced) {
+			continue;
+		}
+		if(TIMEVAL_IS_ZERO(t->sync_at)) {
+			t->sync_at = *now;
+			TIMEVAL_ADD_USEC(t->sync_at, sync_usec);
+		}
+		if(!IS_PAST(t->sync_at, *now)) {
+			resume_sync(t);
+		} else {
+			wait_until(wait, &t->sync_at, now);
+		}
+	}
+}
+
+// Asks server s for the hash pages we still need to seed the transfer
+void
+request_hashes(struct transfer *t, int s) {
+	struct HashRequest hreq;
+	pkt_count p;
+
+	for(p = 0; t->seed_pages > p; p++) {
+		if(BM_ISSET(t->hashed, p)) {
+			continue;
+		}
+		hreq.zero = 0;
+		hreq.announceVer = FBP_HASH_REQUEST;
+		hreq.fileid = t->fileid;
+		hreq.first = p;
+		for(hreq.num = 0; t->seed_pages > p && !BM_ISSET(t->hashed, p); p++) {
+			hreq.num++;
+		}
+		printf("request_hashes(): [%d] Requesting %d hash pages from page %d\n", t->fileid, hreq.num, hreq.first);
+		if(sendto(sfd, &hreq, sizeof(hreq), 0, (struct sockaddr *)&t->servers[s].addr, t->servers[s].addrlen) == -1) {
+			err(1, "sendto");
+		}
+	}
+}
+
+/*
+ * Compares the blocks of a hash page against the seed, and copies the ones
+ * that match. Once we have seen every page, we're done seeding and request
+ * the rest as usual.
+ */
+void
+handle_hashpage(struct HashPage *hpkt, ssize_t pktlen) {
+	struct transfer *t = transfers[hpkt->fileid];
+	char buf[FBP_HASH_BLOCK * FBP_PACKET_DATASIZE];
+	unsigned char hash[FBP_HASH_SIZE];
+	pkt_count b, first, n;
+	ssize_t len;
+	int i, hashes = (pktlen - (ssize_t)(sizeof(*hpkt) - sizeof(hpkt->hashes))) / FBP_HASH_SIZE;
+
+	if(t == NULL || t->seed_fd == -1 || hpkt->page < 0 || hpkt->page >= t->seed_pages || BM_ISSET(t->hashed, hpkt->page)) {
+		return;
+	}
+	for(i = 0; hashes > i && FBP_HASHES_PER_PAGE > i; i++) {
+		b = hpkt->page * FBP_HASHES_PER_PAGE + i;
+		first = b * FBP_HASH_BLOCK;
+		if(first >= t->numPackets) {
+			break;
+		}
+		if((len = pread(t->seed_fd, buf, sizeof(buf), (off_t)first * FBP_PACKET_DATASIZE)) <= 0) {
+			continue;
+		}
+		sha1_block(hash, buf, len);
+		if(memcmp(hash, hpkt->hashes[i], FBP_HASH_SIZE) != 0) {
+			continue;
+		}
+		// The same way as received packets, so the writer and the verifier see them
+		for(n = first; first + (len + FBP_PACKET_DATASIZE - 1) / FBP_PACKET_DATASIZE > n && t->numPackets > n; n++) {
+			if(!wb_have(t, n)) {
+				wb_write(t, n, &buf[(n - first) * FBP_PACKET_DATASIZE], MIN(FBP_PACKET_DATASIZE, len - (ssize_t)(n - first) * FBP_PACKET_DATASIZE));
+				t->seeded++;
+			}
+		}
+	}
+	BM_SET(t->hashed, hpkt->page);
+	if(--t->seed_left > 0) {
+		return;
+	}
+	printf("handle_hashpage(): [%d] Copied %ld of %d packets from the seed\n", t->fileid, t->seeded, t->numPackets);
+	close(t->seed_fd);
+	t->seed_fd = -1;
+	// Ask for the rest right away, instead of at the next announcement
+	memset(t->heard, 0, BM_SIZE(t->numPackets));
+	gettimeofday(&t->request_at, NULL);
+	if(backoff_usec > 0) {
+		TIMEVAL_ADD_USEC(t->request_at, random() % backoff_usec);
+	}
+}
+
+/*
+ * Sends a request to the server, and a copy of it to the group so receivers
+ * that are still backing off can leave these packets out of their requests.
+ * Requests for the peers only go to the group.
+ */
+static void
+send_request(struct transfer *t, int s, void *pkt, size_t len) {
+	struct NackNotice notice;
+
+	if(s != PEERS && sendto(sfd, pkt, len, 0, (struct sockaddr *)&t->servers[s].addr, t->servers[s].addrlen) == -1) {
+		err(1, "sendto");
+	}
+	if(backoff_usec > 0 || s == PEERS) {
+		notice.zero = 0;
+		notice.announceVer = (s == PEERS) ? FBP_PEER_REQUEST : FBP_NACK_NOTICE;
+		memcpy(&notice.request, pkt, len);
+		if(sendto(sfd, &notice, sizeof(notice) - sizeof(notice.request) + len, 0, (struct sockaddr *)&group, sizeof(group)) == -1) {
+			err(1, "sendto");
+		}
+	}
+}
+
+#define	WANTED(t, n, s)	(!BM_ISSET((t)->bitmask, n) && !BM_ISSET((t)->heard, n) && ((s) == PEERS || (t)->route[((n) / FBP_SHARE_PACKETS) % (t)->numservers] == (s)))
+
+/*
+ * Decides which server we ask for the shares of each server: the server
+ * itself if we heard from it lately, otherwise the next one we did hear from.
+ * Servers that are still busy are left alone until they announce they're
+ * waiting, unless we're in the endgame.
+ */
+void
+route_shares(struct transfer *t) {
+	time_t now = time(NULL);
+	int i, j, s, endgame = IN_ENDGAME(t);
+	for(i = 0; t->numservers > i; i++) {
+		t->route[i] = -1;
+		for(j = 0; t->numservers > j; j++) {
+			s = (i + j) % t->numservers;
+			if(t->servers[s].last != 0 && now - t->servers[s].last <= SERVER_TIMEOUT_SEC) {
+				t->route[i] = (t->servers[s].waiting || endgame) ? s : -1;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Requests the packets routed to server s (or all of them, from the peers)
+ * that we're missing and no other receiver asked for this round. For each window of FBP_BITMAP_PACKETS
+ * packets we send whichever is smaller: its missing ranges, or a bitmap of
+ * the whole window.
+ */
+void
+request_from(struct transfer *t, int s) {
+	pkt_count numPackets = t->numPackets;
+	struct RequestPacket rpkt;
+	struct BitmapRequestPacket bpkt;
+	pkt_count w, n, end;
+	int rid = 0, runs;
+
+	bzero(&rpkt, sizeof(rpkt));
+	rpkt.fileid = t->fileid;
+	for(w = 0; numPackets > w; w += FBP_BITMAP_PACKETS) {
+		end = MIN(numPackets, w + FBP_BITMAP_PACKETS);
+		runs = 0;
+		for(n = w; end > n; n++) {
+			if(WANTED(t, n, s) && (n == w || !WANTED(t, n - 1, s))) {
+				runs++;
+			}
+		}
+		if(runs * sizeof(struct _requestData) > sizeof(bpkt)) {
+			bzero(&bpkt, sizeof(bpkt));
+			bpkt.fileid = t->fileid;
+			bpkt.marker = FBP_REQUEST_BITMAP;
+			bpkt.offset = w;
+			for(n = w; end > n; n++) {
+				if(WANTED(t, n, s)) {
+					BM_SET(bpkt.bits, n - w);
+				}
+			}
+			printf("request_from(): [%d] Requesting %d ranges from offset %d as a bitmap from %s %d\n", t->fileid, runs, w, (s == PEERS) ? "peers" : "server", s);
+			send_request(t, s, &bpkt, sizeof(bpkt));
+			continue;
+		}
+		for(n = w; end > n; n++) {
+			if(!WANTED(t, n, s)) {
+				continue;
+			}
+			if(rpkt.requests[rid].num > 0 && rpkt.requests[rid].offset + rpkt.requests[rid].num != n) {
+				printf("request_from(): [%d] Requesting %d packets from offset %d (in rid %d) from %s %d\n", t->fileid, rpkt.requests[rid].num, rpkt.requests[rid].offset, rid, (s == PEERS) ? "peers" : "server", s);
+				if(++rid == FBP_REQUESTS_PER_PACKET) {
+					send_request(t, s, &rpkt, sizeof(rpkt));
+					bzero(&rpkt, sizeof(rpkt));
+					rpkt.fileid = t->fileid;
+					rid = 0;
+				}
+			}
+			if(rpkt.requests[rid].num == 0) {
+				rpkt.requests[rid].offset = n;
+			}
+			rpkt.requests[rid].num++;
+		}
+	}
+	if(rpkt.requests[rid].num > 0) {
+		printf("request_from(): [%d] Requesting %d packets from offset %d from %s %d\n", t->fileid, rpkt.requests[rid].num, rpkt.requests[rid].offset, (s == PEERS) ? "peers" : "server", s);
+		rid++;
+	}
+	if(rid > 0) {
+		send_request(t, s, &rpkt, sizeof(rpkt));
+	}
+}
+
+/*
+ * Requests what we're missing from the peers, or from the servers the shares
+ * are routed to. Returns the number of packets we're missing.
+ */
+pkt_count
+request_missing(struct transfer *t, int peers) {
+	pkt_count n, missing = 0;
+	int s;
+
+	// this round's requests cover the gaps
+	memset(t->gaps, 0, BM_SIZE(t->numPackets));
+	memset(t->nacked, 0, BM_SIZE(t->numPackets));
+	TIMEVAL_CLEAR(t->gap_at);
+	for(n = 0; t->numPackets > n; n++) {
+		if(!BM_ISSET(t->bitmask, n)) {
+			missing++;
+		}
+	}
+	if(missing == 0) {
+		return 0;
+	}
+	if(peers) {
+		request_from(t, PEERS);
+		return missing;
+	}
+	route_shares(t);
+	for(s = 0; t->numservers > s; s++) {
+		request_from(t, s);
+	}
+	return missing;
+}
+
+void
+handle_announcement(struct Announcement *apkt, ssize_t pktlen, struct sockaddr_in *raddr, socklen_t raddrlen) {
+	struct server *s;
+
+	if(apkt->announceVer > FBP_ANNOUNCE_VERSION) {
+		printf("handle_announcement(): Dropping too high version\n");
+		return;
+	}
+	if(pktlen < sizeof(*apkt)) {
+		// From an older server, the fields it doesn't know about are zero
+		memset((char *)apkt + pktlen, 0, sizeof(*apkt) - pktlen);
+	}
+	if((direct_fid != 0 && apkt->fileid != direct_fid) || (stream_fid != 0 && apkt->fileid != stream_fid)) {
+		// We only image or stream one file
+		return;
+	}
+	if(transfers[apkt->fileid] == NULL) {
+		printf("handle_announcement(): Unknown file-id %d; starting transfer\n", apkt->fileid);
+		start_transfer(apkt);
+	}
+	struct transfer *t = transfers[apkt->fileid];
+	if(t->done) {
+		return;
+	}
+	if(t->numservers != MAX(1, apkt->serverCount) || apkt->serverIndex >= t->numservers
+	 || (t->open ? t->numPackets > apkt->numPackets
+	             : memcmp(t->checksum, apkt->checksum, sizeof(t->checksum)) != 0 || t->numPackets != apkt->numPackets)) {
+		printf("handle_announcement(): [%d] Announcement doesn't match the file we're receiving, ignoring\n", apkt->fileid);
+		return;
+	}
+	if(t->open) {
+		// The file may have grown, or be complete now
+		if(apkt->numPackets > t->numPackets) {
+			grow_transfer(t, apkt->numPackets);
+		}
+		if(!(apkt->flags & FBP_FLAG_OPEN)) {
+			printf("handle_announcement(): [%d] File is complete at %d packets\n", apkt->fileid, apkt->numPackets);
+			memcpy(t->checksum, apkt->checksum, sizeof(t->checksum));
+			t->open = 0;
+			if(rfd != -1) {
+				memcpy(t->announcement.checksum, apkt->checksum, sizeof(t->announcement.checksum));
+				t->announcement.flags &= ~FBP_FLAG_OPEN;
+			}
+		}
+	}
+	s = &t->servers[apkt->serverIndex];
+	memcpy(&s->addr, raddr, raddrlen);
+	s->addrlen = raddrlen;
+	s->last = time(NULL);
+	s->waiting = (apkt->status == FBP_STATUS_WAITING);
+	t->unicast = ((apkt->flags & FBP_FLAG_UNICAST) != 0);
+	if(apkt->numLayers > numlayers) {
+		numlayers = MIN(apkt->numLayers, FBP_MAX_LAYERS);
+	}
+	if(t->seed_fd != -1) {
+		// Find out what we can copy from the seed before we request anything
+		request_hashes(t, apkt->serverIndex);
+		return;
+	}
+	int endgame = IN_ENDGAME(t);
+	if(apkt->status == FBP_STATUS_TRANSFERRING && !endgame) {
+		printf("handle_announcement(): [%d] Transfer is running; I can wait\n", apkt->fileid);
+		return;
+	}
+
+	if(!TIMEVAL_IS_ZERO(t->request_at) || !TIMEVAL_IS_ZERO(t->peers_until)) {
+		// We're already backing off or asking the peers for this round
+		return;
+	}
+
+	// Hold back our requests for a random time, and leave out whatever the
+	// other receivers request in the meantime
+	memset(t->heard, 0, BM_SIZE(t->numPackets));
+	gettimeofday(&t->request_at, NULL);
+	if(backoff_usec > 0 && !endgame) {
+		TIMEVAL_ADD_USEC(t->request_at, random() % backoff_usec);
+	}
+}
+
+void
+finish_transfer(struct transfer *t) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	now.tv_sec -= t->start.tv_sec;
+	now.tv_usec -= t->start.tv_usec;
+	if(now.tv_usec < 0) {
+		now.tv_usec += 1000000;
+		now.tv_sec--;
+	}
+	printf("finish_transfer(): [%d] Ready in %ld.%06ld seconds, %.0f kB/s of data, %.0f kB/s on the wire\n", t->fileid, now.tv_sec, now.tv_usec,
+		t->data_bytes / 1024.0 / (now.tv_sec + now.tv_usec / 1000000.0), t->wire_bytes / 1024.0 / (now.tv_sec + now.tv_usec / 1000000.0));
+	char checksum[sizeof(t->checksum)];
+	pkt_count ahead = t->prefix;
+	if(direct_path != NULL) {
+		if(fdatasync(t->fd) == -1) {
+			err(1, "fdatasync(%s)", direct_path);
+		}
+		if(ftruncate(t->fd, t->size) == -1 && errno != EINVAL) {
+			// EINVAL: not a regular file
+			err(1, "ftruncate(%s)", direct_path);
+		}
+	}
+	// Have the verifier hash the rest; the other transfers may hold all buffers
+	if(free_buffers == 0 && in_pipeline == 0) {
+		wb_flush_coldest();
+	}
+	struct extent *e = pipeline_get();
+	e->finish = 1;
+	pipeline_send(t, e);
+	pipeline_drain(t);
+	if(t->prefix == t->numPackets) {
+		printf("finish_transfer(): [%d] Hashed %d packets as they came in, %d now\n", t->fileid, ahead, t->numPackets - ahead);
+		sha1_hex(checksum, t->digest);
+	} else if(direct_path != NULL) {
+		sha1_range(checksum, t->fd, t->size);
+	} else {
+		sha1_file(checksum, t->fd);
+	}
+	if(strncmp(t->checksum, checksum, sizeof(checksum)) != 0 && t->fileid == stream_fid && stream_avail > 0) {
+		errx(1, "finish_transfer(): [%d] Checksum mismatch: %.*s != %.*s, after streaming part of it", t->fileid, (int)sizeof(checksum), t->checksum, (int)sizeof(checksum), checksum);
+	}
+	if(strncmp(t->checksum, checksum, sizeof(checksum)) != 0) {
+		printf("finish_transfer(): [%d] Checksum mismatch: %.*s != %.*s. Restarting transfer.\n", t->fileid, (int)sizeof(checksum), t->checksum, (int)sizeof(checksum), checksum);
+		memset(t->bitmask, 0, BM_SIZE(t->numPackets));
+		memset(t->ondisk, 0, BM_SIZE(t->numPackets));
+		t->have = 0;
+		t->unsynced = 1;
+		t->prefix = 0;
+		SHA1_Init(&t->sha);
+	} else {
+		t->done = 1;
+		resume_done(t);
+		if(t->fileid == stream_fid) {
+			stream_offer(t->size, 1);
+			if(peer_pps == 0 && rfd == -1) {
+				// nothing left for us to do once the reader has it all
+				pthread_join(streamer, NULL);
+				exit(0);
+			}
+		}
+		if(peer_pps == 0 && rfd == -1) {
+			close(t->fd);
+			t->fd = -1;
+			if(t->dfd != -1) {
+				close(t->dfd);
+				t->dfd = -1;
+			}
+		}
+	}
+}
+
+/*
+ * Sends the requests of every transfer whose backoff has ended, to the peers
+ * first if we do peer repair, and to the servers once the peers went quiet.
+ */
+void
+send_pending_requests(struct timeval *now) {
+	int i;
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		struct transfer *t = transfers[i];
+		if(t == NULL || t->done) {
+			continue;
+		}
+		if(!TIMEVAL_IS_ZERO(t->peers_until) && !IS_PAST(t->peers_until, *now)) {
+			TIMEVAL_CLEAR(t->peers_until);
+			wb_flush_all(t);
+			if(request_missing(t, 0) == 0 && !t->open) {
+				finish_transfer(t);
+			}
+			continue;
+		}
+		if(TIMEVAL_IS_ZERO(t->request_at) || IS_PAST(t->request_at, *now)) {
+			continue;
+		}
+		TIMEVAL_CLEAR(t->request_at);
+		wb_flush_all(t);
+		if(request_missing(t, peer_pps > 0) == 0) {
+			if(!t->open) {
+				finish_transfer(t);
+			}
+		} else if(peer_pps > 0) {
+			t->peers_until = *now;
+			TIMEVAL_ADD_USEC(t->peers_until, PEER_IDLE_USEC);
+		}
+	}
+}
+
+// Sets the packets a notice requests in mask
+void
+mark_requested(struct transfer *t, bm_datatype *mask, struct NackNotice *notice, ssize_t len) {
+	pkt_count n;
+	int i;
+
+	if(len == sizeof(struct BitmapRequestPacket) && notice->request.bitmap.marker == FBP_REQUEST_BITMAP) {
+		struct BitmapRequestPacket *bpkt = &notice->request.bitmap;
+		if(bpkt->offset < 0 || bpkt->offset % FBP_BITMAP_PACKETS != 0) {
+			return;
+		}
+		for(i = 0; FBP_BITMAP_PACKETS / BM_BITS_PER_UNIT > i && t->numPackets > bpkt->offset + i * (pkt_count)BM_BITS_PER_UNIT; i++) {
+			mask[bpkt->offset / BM_BITS_PER_UNIT + i] |= bpkt->bits[i];
+		}
+	} else if(len == sizeof(struct RequestPacket)) {
+		struct RequestPacket *rpkt = &notice->request.ranges;
+		for(i = 0; FBP_REQUESTS_PER_PACKET > i; i++) {
+			if(rpkt->requests[i].offset < 0 || rpkt->requests[i].num < 0 || rpkt->requests[i].offset + rpkt->requests[i].num > t->numPackets) {
+				return;
+			}
+			for(n = rpkt->requests[i].offset; rpkt->requests[i].offset + rpkt->requests[i].num > n; n++) {
+				BM_SET(mask, n);
+			}
+		}
+	}
+}
+
+/*
+ * Marks the packets another receiver requested, so we don't request them
+ * too. If it asked the peers, we queue whatever of it we have as repairs.
+ */
+void
+handle_nacknotice(struct NackNotice *notice, ssize_t pktlen) {
+	ssize_t len = pktlen - (sizeof(*notice) - sizeof(notice->request));
+	struct transfer *t = transfers[(unsigned char)notice->request.ranges.fileid];
+	pkt_count n;
+	int i;
+
+	if(t == NULL || rfd != -1) {
+		// A relay can't tell the segments apart, so it asks for itself
+		return;
+	}
+	if(notice->announceVer == FBP_PEER_REQUEST && peer_pps > 0 && t->fd != -1) {
+		mark_requested(t, t->repair, notice, len);
+		for(i = 0; BM_UNITS(t->numPackets) > i; i++) {
+			t->repair[i] &= t->bitmask[i];
+		}
+		if(TIMEVAL_IS_ZERO(t->repair_at)) {
+			// Start somewhere random, so peers answering the same request
+			// mostly send different packets
+			gettimeofday(&t->repair_at, NULL);
+			TIMEVAL_ADD_USEC(t->repair_at, random() % PEER_BACKOFF_USEC);
+			t->repair_next = random() % MAX(1, t->numPackets);
+		}
+	}
+	if(t->done || t->unicast) {
+		return;
+	}
+	if(TIMEVAL_IS_ZERO(t->request_at)) {
+		if(notice->announceVer == FBP_NACK_NOTICE) {
+			// The server sends what the sweep passed again now; the rest
+			// still comes in this sweep, and we may lose it yet
+			mark_requested(t, t->nacked, notice, len);
+			for(n = t->front + 1; t->numPackets > n && n % BM_BITS_PER_UNIT != 0; n++) {
+				BM_CLR(t->nacked, n);
+			}
+			if(t->numPackets > n) {
+				memset(&t->nacked[n / BM_BITS_PER_UNIT], 0, BM_SIZE(t->numPackets) - n / BM_BITS_PER_UNIT * sizeof(bm_datatype));
+			}
+		}
+		return;
+	}
+	mark_requested(t, t->heard, notice, len);
+}
+
+// Broadcasts the next repair of every transfer that may send one
+void
+send_repairs(struct timeval *now) {
+	struct DataPacket dpkt;
+	ssize_t len;
+	pkt_count n;
+	int i;
+
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		struct transfer *t = transfers[i];
+		if(t == NULL || TIMEVAL_IS_ZERO(t->repair_at) || IS_PAST(t->repair_at, *now)) {
+			continue;
+		}
+		for(n = t->repair_next; t->numPackets > n && !BM_ISSET(t->repair, n); n++);
+		if(n == t->numPackets) {
+			for(n = 0; t->repair_next > n && !BM_ISSET(t->repair, n); n++);
+			if(n == t->repair_next) {
+				// nothing left to repair
+				TIMEVAL_CLEAR(t->repair_at);
+				continue;
+			}
+		}
+		BM_CLR(t->repair, n);
+		t->repair_next = n + 1;
+		if((len = pread(t->fd, dpkt.data, FBP_PACKET_DATASIZE, (off_t)n * FBP_PACKET_DATASIZE)) <= 0) {
+			err(1, "pread");
+		}
+		dpkt.fileid = t->fileid;
+		dpkt.seq = 0;
+		dpkt.size = len;
+		dpkt.offset = n;
+		if(sendto(sfd, &dpkt, sizeof(dpkt) - FBP_PACKET_DATASIZE + len, 0, (struct sockaddr *)&group, sizeof(group)) == -1) {
+			err(1, "sendto");
+		}
+		t->repaired++;
+		TIMEVAL_ADD_USEC(t->repair_at, 1000000 / peer_pps);
+		if(IS_PAST(*now, t->repair_at)) {
+			// don't make up for lost time in a burst
+			t->repair_at = *now;
+		}
+	}
+}
+
+// Notes the packets the sweep of the server skipped on its way to packet n
+void
+track_gaps(struct transfer *t, pkt_count n) {
+	struct timeval rate;
+	pkt_count m;
+	int found = 0;
+
+	if(t->numservers > 1 || subscribed < numlayers) {
+		return;
+	}
+	if(t->front != -1 && n > t->front + 1 && t->front + GAP_MAX_JUMP >= n) {
+		for(m = t->front + 1; n > m; m++) {
+			if(!wb_have(t, m) && !BM_ISSET(t->nacked, m)) {
+				BM_SET(t->gaps, m);
+				t->gap_first = MIN(t->gap_first, m);
+				found = 1;
+			}
+		}
+	}
+	if(found && TIMEVAL_IS_ZERO(t->gap_at)) {
+		gettimeofday(&t->gap_at, NULL);
+		TIMEVAL_ADD_USEC(t->gap_at, GAP_HOLD_USEC + random() % GAP_HOLD_USEC);
+		rate = t->gap_sent;
+		TIMEVAL_ADD_USEC(rate, GAP_NACK_USEC);
+		if(IS_PAST(rate, t->gap_at)) {
+			t->gap_at = rate;
+		}
+	}
+	if(n > t->front || t->front - n > GAP_MAX_JUMP) {
+		// on, or the next sweep
+		t->front = n;
+	}
+}
+
+// Requests the gaps of every transfer that held them long enough
+void
+send_gap_nacks(struct timeval *now) {
+	struct RequestPacket rpkt;
+	pkt_count n, nacked;
+	int i, rid, sent;
+
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		struct transfer *t = transfers[i];
+		if(t == NULL || TIMEVAL_IS_ZERO(t->gap_at) || IS_PAST(t->gap_at, *now)) {
+			continue;
+		}
+		TIMEVAL_CLEAR(t->gap_at);
+		if(t->done || t->servers[0].last == 0) {
+			continue;
+		}
+		bzero(&rpkt, sizeof(rpkt));
+		rpkt.fileid = t->fileid;
+		rid = sent = nacked = 0;
+		for(n = t->gap_first; t->numPackets > n; n++) {
+			if(!BM_ISSET(t->gaps, n)) {
+				continue;
+			}
+			if(wb_have(t, n) || BM_ISSET(t->nacked, n)) {
+				// reordered after all, or somebody else asked
+				BM_CLR(t->gaps, n);
+				continue;
+			}
+			if(rpkt.requests[rid].num > 0 && rpkt.requests[rid].offset + rpkt.requests[rid].num != n && ++rid == FBP_REQUESTS_PER_PACKET) {
+				send_request(t, 0, &rpkt, sizeof(rpkt));
+				bzero(&rpkt, sizeof(rpkt));
+				rpkt.fileid = t->fileid;
+				rid = 0;
+				if(++sent == GAP_NACK_PACKETS) {
+					// the rest after the next interval
+					t->gap_at = *now;
+					TIMEVAL_ADD_USEC(t->gap_at, GAP_NACK_USEC);
+					break;
+				}
+			}
+			if(rpkt.requests[rid].num == 0) {
+				rpkt.requests[rid].offset = n;
+			}
+			rpkt.requests[rid].num++;
+			BM_CLR(t->gaps, n);
+			BM_SET(t->nacked, n);
+			nacked++;
+		}
+		t->gap_first = n;
+		if(rpkt.requests[0].num > 0) {
+			send_request(t, 0, &rpkt, sizeof(rpkt));
+		}
+		if(nacked > 0) {
+			printf("send_gap_nacks(): [%d] Requesting %d packets the sweep passed, before %d\n", t->fileid, nacked, t->front);
+		}
+		t->gap_nacked += nacked;
+		t->gap_sent = *now;
+	}
+}
+
+/*
+ * Requests the packets missing right after the prefix that the server must
+ * have passed, as we have a later one of the next STREAM_URGENT, and that we
+ * didn't ask for yet; all of them again once the stream didn't move for
+ * STREAM_RETRY_USEC. Shortens *wait to when we look again.
+ */
+void
+stream_urge(long *wait, struct timeval *now) {
+	struct transfer *t = transfers[stream_fid];
+	struct RequestPacket rpkt;
+	struct timeval retry;
+	pkt_count n, prefix, last, upto;
+	int s, rid, urged = 0;
+
+	if(stream_fid == 0 || t == NULL || t->done || subscribed < numlayers) {
+		return;
+	}
+	if(IS_PAST(stream_urge_at, *now)) {
+		wait_until(wait, &stream_urge_at, now);
+		return;
+	}
+	stream_urge_at = *now;
+	TIMEVAL_ADD_USEC(stream_urge_at, STREAM_URGE_USEC);
+	wait_until(wait, &stream_urge_at, now);
+	pthread_mutex_lock(&verify_lock);
+	prefix = t->prefix;
+	pthread_mutex_unlock(&verify_lock);
+	retry = stream_moved;
+	TIMEVAL_ADD_USEC(retry, STREAM_RETRY_USEC);
+	if(prefix != stream_stalled || !IS_PAST(retry, *now)) {
+		// moved, or stuck long enough to ask again
+		stream_stalled = prefix;
+		stream_moved = *now;
+		stream_urged = prefix;
+	}
+	if(!TIMEVAL_IS_ZERO(t->request_at) || !TIMEVAL_IS_ZERO(t->peers_until)) {
+		// this round's requests are about to cover it
+		return;
+	}
+	for(last = MIN(t->numPackets, prefix + STREAM_URGENT) - 1; last > stream_urged && !wb_have(t, last); last--);
+	upto = last;
+	for(s = 0; t->numservers > s; s++) {
+		if(t->servers[s].last == 0) {
+			continue;
+		}
+		bzero(&rpkt, sizeof(rpkt));
+		rpkt.fileid = t->fileid;
+		rid = 0;
+		for(n = stream_urged; last > n; n++) {
+			if(wb_have(t, n) || (n / FBP_SHARE_PACKETS) % t->numservers != s) {
+				continue;
+			}
+			if(rpkt.requests[rid].num > 0 && rpkt.requests[rid].offset + rpkt.requests[rid].num != n && ++rid == FBP_REQUESTS_PER_PACKET - 1) {
+				// the rest next time
+				upto = MIN(upto, n);
+				break;
+			}
+			if(rpkt.requests[rid].num == 0) {
+				rpkt.requests[rid].offset = n;
+			}
+			rpkt.requests[rid].num++;
+			// no need for a gap NACK as well
+			BM_SET(t->nacked, n);
+			urged++;
+		}
+		if(rpkt.requests[0].num > 0) {
+			rpkt.requests[FBP_REQUESTS_PER_PACKET - 1].offset = FBP_REQUEST_URGENT;
+			send_request(t, s, &rpkt, sizeof(rpkt));
+		}
+	}
+	stream_urged = MAX(stream_urged, upto);
+	if(urged > 0) {
+		printf("stream_urge(): [%d] Requesting %d packets the stream waits for, from %d\n", t->fileid, urged, prefix);
+	}
+}
+
+// wirelen is what dpkt took on the wire, 0 if it came in a compressed packet we counted already
+void
+handle_datapacket(struct DataPacket *dpkt, ssize_t pktlen, ssize_t wirelen, int from_peer) {
+	if(transfers[dpkt->fileid] == NULL) {
+		// XXX bufferen ?
+		return;
+	}
+	struct transfer *t = transfers[dpkt->fileid];
+	if(t->open && !from_peer && dpkt->offset >= t->numPackets && dpkt->size == FBP_PACKET_DATASIZE
+	 && GROW_WINDOW > dpkt->offset - t->numPackets && INT_MAX > dpkt->offset) {
+		// Data past the end of a streamed file tells us it grew
+		grow_transfer(t, dpkt->offset + 1);
+	}
+	if(dpkt->offset < 0 || dpkt->offset >= t->numPackets) {
+		return;
+	}
+	t->received++;
+	t->wire_bytes += wirelen;
+	t->data_bytes += pktlen - (ssize_t)(sizeof(*dpkt) - sizeof(dpkt->data));
+	// Somebody else repaired this one already
+	BM_CLR(t->repair, dpkt->offset);
+	if(t->done || wb_have(t, dpkt->offset)) {
+		t->unneeded++;
+	}
+	if(t->done) {
+		// transfer is complete
+		return;
+	}
+	if(from_peer && !wb_have(t, dpkt->offset)) {
+		t->from_peers++;
+		if(!TIMEVAL_IS_ZERO(t->peers_until)) {
+			// The peers are still helping us, keep waiting for them
+			gettimeofday(&t->peers_until, NULL);
+			TIMEVAL_ADD_USEC(t->peers_until, PEER_IDLE_USEC);
+		}
+	}
+	if(!from_peer) {
+		track_gaps(t, dpkt->offset);
+	}
+	if(BM_ISSET(t->bitmask, dpkt->offset) || BM_ISSET(t->inflight, dpkt->offset)) {
+		// written out already, or being written
+		return;
+	}
+	wb_write(t, dpkt->offset, dpkt->data, MIN(FBP_PACKET_DATASIZE, FBP_PACKET_DATASIZE - sizeof(struct DataPacket) + pktlen));
+}
+
+/*
+ * The server tells us these packets are all zero, instead of sending them.
+ * We make them holes in the file; the last packet is never in a zero map,
+ * so the file still ends up at the right length. When imaging a disk, we write
+ * the zeros after all, as the disk holds whatever was there before.
+ */
+void
+handle_zeromap(struct ZeroMap *zpkt, ssize_t pktlen) {
+	struct transfer *t = transfers[(unsigned char)zpkt->ranges.fileid];
+	int i, ranges = (pktlen - (ssize_t)(sizeof(*zpkt) - sizeof(zpkt->ranges.requests))) / sizeof(struct _requestData);
+	pkt_count n, hole;
+
+	if(t == NULL || t->done) {
+		return;
+	}
+	for(i = 0; ranges > i && FBP_REQUESTS_PER_PACKET > i; i++) {
+		struct _requestData *r = &zpkt->ranges.requests[i];
+		if(r->offset < 0 || r->num < 0 || r->offset + r->num > t->numPackets) {
+			return;
+		}
+		hole = -1;
+		for(n = r->offset; r->offset + r->num > n; n++) {
+			BM_CLR(t->repair, n);
+			if(BM_ISSET(t->bitmask, n) || BM_ISSET(t->inflight, n)) {
+				if(hole != -1) {
+					punch_zeros(t, hole, n);
+					hole = -1;
+				}
+				continue;
+			}
+			if(direct_path != NULL) {
+				// the disk isn't empty, so we have to write them
+				static const char zeros[FBP_PACKET_DATASIZE];
+				wb_write(t, n, zeros, FBP_PACKET_DATASIZE);
+			} else {
+				hole = (hole == -1) ? n : hole;
+				BM_SET_ATOMIC(t->ondisk, n);
+				mark_received(t, n);
+			}
+			t->zeroed++;
+		}
+		if(hole != -1) {
+			punch_zeros(t, hole, n);
+		}
+	}
+}
+
+#ifdef COMPRESSION
+// Whether buf is a compressed data packet, which the receive thread decompresses
+static inline int
+is_compressed(char *buf, ssize_t len) {
+	return len >= (ssize_t)(sizeof(struct DataPacket) - FBP_PACKET_DATASIZE) && buf[0] != 0
+	 && (((struct DataPacket *)buf)->size & FBP_SIZE_COMPRESSED);
+}
+
+/*
+ * A compressed data packet holds several packets from its offset on; we
+ * handle each of them as if it came on its own. The receive thread already
+ * decompressed it into the first slot of unz_queue.
+ */
+void
+handle_compressed(struct DataPacket *dpkt, ssize_t pktlen, int from_peer) {
+	struct unzbuf *unz = &unzbufs[unz_queue.tail % unz_queue.size];
+	ssize_t hdrlen = sizeof(*dpkt) - sizeof(dpkt->data);
+	struct DataPacket part;
+	size_t len = unz->len, i;
+
+	if(ZSTD_isError(len)) {
+		printf("handle_compressed(): [%d] Can't decompress packet %d: %s\n", dpkt->fileid, dpkt->offset, ZSTD_getErrorName(len));
+		return;
+	}
+	for(i = 0; len > i * FBP_PACKET_DATASIZE; i++) {
+		part.fileid = dpkt->fileid;
+		part.seq = dpkt->seq;
+		part.size = MIN(FBP_PACKET_DATASIZE, len - i * FBP_PACKET_DATASIZE);
+		part.offset = dpkt->offset + i;
+		memcpy(part.data, &unz->data[i * FBP_PACKET_DATASIZE], part.size);
+		handle_datapacket(&part, hdrlen + part.size, (i == 0) ? pktlen - hdrlen : 0, from_peer);
+	}
+}
+#endif
+
+static void inline
+relay_queue(struct transfer *t, pkt_count n) {
+	if(BM_ISSET(t->bitmask, n)) {
+		if(!BM_ISSET(t->relay_ready, n)) {
+			BM_SET(t->relay_ready, n);
+			t->relay_queued++;
+		}
+	} else if(!BM_ISSET(t->relay_wanted, n)) {
+		BM_SET(t->relay_wanted, n);
+		t->relay_waiting++;
+	}
+}
+
+// Queues what a receiver on the relayed segment asked for
+void
+relay_receive() {
+	union {
+		struct RequestPacket r;
+		struct BitmapRequestPacket b;
+	} buf;
+	struct transfer *t;
+	ssize_t len;
+	pkt_count n;
+	int i, j;
+
+	if((len = recv(rfd, &buf, sizeof(buf), 0)) == -1) {
+		err(1, "recv");
+	}
+	if(len < 1 || (t = transfers[buf.r.fileid]) == NULL) {
+		return;
+	}
+	if(len == sizeof(struct BitmapRequestPacket) && buf.b.marker == FBP_REQUEST_BITMAP) {
+		if(buf.b.offset < 0 || buf.b.offset >= t->numPackets || buf.b.offset % FBP_BITMAP_PACKETS != 0) {
+			return;
+		}
+		for(n = buf.b.offset; t->numPackets > n && buf.b.offset + FBP_BITMAP_PACKETS > n; n++) {
+			if(BM_ISSET(buf.b.bits, n - buf.b.offset)) {
+				relay_queue(t, n);
+			}
+		}
+	} else if(len == sizeof(struct RequestPacket)) {
+		for(i = 0; FBP_REQUESTS_PER_PACKET > i; i++) {
+			if(buf.r.requests[i].offset < 0 || buf.r.requests[i].num < 0 || buf.r.requests[i].offset + buf.r.requests[i].num > t->numPackets) {
+				return;
+			}
+			for(j = 0; buf.r.requests[i].num > j; j++) {
+				relay_queue(t, buf.r.requests[i].offset + j);
+			}
+		}
+	}
+}
+
+void
+relay_announce(struct transfer *t) {
+	t->announcement.status = (t->relay_waiting + t->relay_queued > 0) ? FBP_STATUS_TRANSFERRING : FBP_STATUS_WAITING;
+	if(sendto(rfd, &t->announcement, sizeof(t->announcement), 0, (struct sockaddr *)&relay_group, sizeof(relay_group)) == -1) {
+		err(1, "sendto");
+	}
+}
+
+// Announces our files every second, and sends the next queued packet we have
+void
+relay_send(struct timeval *now) {
+	static int cur = 0;
+	struct DataPacket dpkt;
+	struct transfer *t = NULL;
+	ssize_t len;
+	pkt_count n;
+	int i;
+
+	if(!IS_PAST(relay_announce_at, *now)) {
+		for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+			if(transfers[i] != NULL) {
+				relay_announce(transfers[i]);
+			}
+		}
+		relay_announce_at = *now;
+		TIMEVAL_ADD_USEC(relay_announce_at, RELAY_ANNOUNCE_USEC);
+	}
+	if(IS_PAST(relay_at, *now)) {
+		return;
+	}
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		cur = (cur + 1) % (sizeof(transfers) / sizeof(transfers[0]));
+		if(transfers[cur] != NULL && transfers[cur]->relay_queued > 0) {
+			t = transfers[cur];
+			break;
+		}
+	}
+	if(t == NULL) {
+		return;
+	}
+	for(n = t->relay_next; !BM_ISSET(t->relay_ready, n); n = (n + 1) % t->numPackets);
+	BM_CLR(t->relay_ready, n);
+	t->relay_queued--;
+	t->relay_next = (n + 1) % t->numPackets;
+	if((len = pread(t->fd, dpkt.data, FBP_PACKET_DATASIZE, (off_t)n * FBP_PACKET_DATASIZE)) <= 0) {
+		err(1, "pread");
+	}
+	dpkt.fileid = t->fileid;
+	dpkt.seq = 0;
+	dpkt.size = len;
+	dpkt.offset = n;
+	if(sendto(rfd, &dpkt, sizeof(dpkt) - FBP_PACKET_DATASIZE + len, 0, (struct sockaddr *)&relay_group, sizeof(relay_group)) == -1) {
+		err(1, "sendto");
+	}
+	t->relayed++;
+	if(t->relay_queued + t->relay_waiting == 0) {
+		// Don't let the local receivers wait for the next second
+		relay_announce(t);
+	}
+	TIMEVAL_ADD_USEC(relay_at, 1000000 / relay_pps);
+	if(IS_PAST(*now, relay_at)) {
+		relay_at = *now;
+	}
+}
+
+void
+rx_init() {
+	unsigned int i;
+#ifdef UDP_GRO
+	if(use_gro) {
+		rxsize = RECV_GRO_SIZE;
+		rx_queue.size = RX_QUEUE_GRO;
+	}
+#endif
+	if((rxbufs = calloc(rx_queue.size, sizeof(struct rxbuf))) == NULL) {
+		err(1, "calloc() (receive buffers)");
+	}
+	for(i = 0; rx_queue.size > i; i++) {
+		if((rxbufs[i].data = malloc(rxsize)) == NULL) {
+			err(1, "malloc() (receive buffers)");
+		}
+	}
+#ifdef COMPRESSION
+	if((unzbufs = malloc(unz_queue.size * sizeof(struct unzbuf))) == NULL) {
+		err(1, "malloc() (decompression buffers)");
+	}
+#endif
+}
+
+void
+rx_setup(int fd) {
+#ifdef UDP_GRO
+	int opt = 1;
+	if(use_gro && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt)) == -1) {
+		warn("setsockopt(UDP_GRO)");
+	}
+#endif
+}
+
+/*
+ * Reads the next batch from layer l into at most max rxbufs from first on;
+ * returns how many it got
+ */
+int
+rx_batch(int l, unsigned int first, int max) {
+	int fd = layers[l].fd, n, i;
+	long datagrams = 0;
+#ifdef MSG_WAITFORONE
+	struct cmsghdr *cmsg;
+	struct rxbuf *rx;
+
+	for(i = 0; max > i; i++) {
+		rx = &rxbufs[first + i];
+		rxiov[i].iov_base = rx->data;
+		rxiov[i].iov_len = rxsize;
+		rxmsgs[i].msg_hdr.msg_name = &rx->addr;
+		rxmsgs[i].msg_hdr.msg_namelen = sizeof(rx->addr);
+		rxmsgs[i].msg_hdr.msg_iov = &rxiov[i];
+		rxmsgs[i].msg_hdr.msg_iovlen = 1;
+		rxmsgs[i].msg_hdr.msg_control = rx->control;
+		rxmsgs[i].msg_hdr.msg_controllen = use_gro ? sizeof(rx->control) : 0;
+		rxmsgs[i].msg_hdr.msg_flags = 0;
+	}
+	if((n = recvmmsg(fd, rxmsgs, max, MSG_DONTWAIT, NULL)) == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		err(1, "recvmmsg");
+	}
+	for(i = 0; n > i; i++) {
+		rx = &rxbufs[first + i];
+		rx->len = rxmsgs[i].msg_len;
+		rx->addrlen = rxmsgs[i].msg_hdr.msg_namelen;
+		rx->segsize = 0;
+		rx->layer = l;
+#ifdef UDP_GRO
+		for(cmsg = CMSG_FIRSTHDR(&rxmsgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&rxmsgs[i].msg_hdr, cmsg)) {
+			if(cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+				memcpy(&rx->segsize, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+#endif
+		datagrams += (rx->segsize > 0) ? (rx->len + rx->segsize - 1) / rx->segsize : 1;
+	}
+#else
+	struct rxbuf *rx = &rxbufs[first];
+
+	rx->addrlen = sizeof(rx->addr);
+	if((rx->len = recvfrom(fd, rx->data, rxsize, MSG_DONTWAIT, (struct sockaddr *)&rx->addr, &rx->addrlen)) == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		err(1, "recvfrom");
+	}
+	rx->segsize = 0;
+	rx->layer = l;
+	n = datagrams = 1;
+#endif
+	if(n > 0) {
+		rx_calls++;
+		rx_buffers += n;
+		rx_datagrams += datagrams;
+		rx_most = MAX(rx_most, datagrams);
+	}
+	return n;
+}
+
+// Opens the socket of layer l, on the receive thread
+void
+rx_join(int l) {
+	struct sockaddr_in laddr = addr;
+
+	laddr.sin_port = htons(FBP_DEFAULT_PORT + l);
+	if((layers[l].fd = socket(laddr.sin_family, SOCK_DGRAM, 0)) == -1) {
+		err(1, "socket");
+	}
+	if(bind(layers[l].fd, (struct sockaddr *)&laddr, sizeof(laddr)) == -1) {
+		err(1, "bind");
+	}
+	rx_setup(layers[l].fd);
+}
+
+#ifdef COMPRESSION
+/*
+ * Decompresses the compressed data packets in the n rxbufs from first on into
+ * unz_queue. When that is full, it queues the rxbufs before the one it is
+ * at, so the main thread can give their slots back. Returns how many it
+ * queued.
+ */
+unsigned int
+rx_decompress(unsigned int first, unsigned int n) {
+	struct DataPacket *dpkt;
+	struct unzbuf *unz;
+	ssize_t hdrlen = sizeof(*dpkt) - sizeof(dpkt->data), off, len;
+	unsigned int i, queued = 0;
+	struct rxbuf *rx;
+
+	for(i = 0; n > i; i++) {
+		rx = &rxbufs[first + i];
+		for(off = 0; rx->len > off; off += (rx->segsize > 0) ? rx->segsize : rx->len) {
+			len = (rx->segsize > 0) ? MIN(rx->segsize, rx->len - off) : rx->len;
+			if(!is_compressed(rx->data + off, len)) {
+				continue;
+			}
+			if(queue_space(&unz_queue) == 0) {
+				unz_queue.waits++;
+				if(i > queued) {
+					queue_push(&rx_queue, i - queued);
+					queued = i;
+					wake_main();
+				}
+				while(queue_space(&unz_queue) == 0) {
+					usleep(QUEUE_FULL_USEC);
+				}
+			}
+			dpkt = (struct DataPacket *)(rx->data + off);
+			unz = &unzbufs[unz_queue.head % unz_queue.size];
+			unz->len = ZSTD_decompress(unz->data, sizeof(unz->data), dpkt->data, MIN(dpkt->size & ~FBP_SIZE_COMPRESSED, len - hdrlen));
+			queue_push(&unz_queue, 1);
+		}
+	}
+	return queued;
+}
+#endif
+
+/*
+ * Receive thread: follows the main thread joining and leaving layers, and
+ * drains the sockets into rx_queue
+ */
+void *
+rx_thread(void *arg) {
+	struct pollfd pfds[FBP_MAX_LAYERS];
+	unsigned int slot;
+	int i, n, round, joined = 1, want;
+
+	while(1) {
+		want = __atomic_load_n(&subscribed, __ATOMIC_ACQUIRE);
+		for(; want > joined; joined++) {
+			rx_join(joined);
+		}
+		for(; joined > want; joined--) {
+			close(layers[joined - 1].fd);
+			layers[joined - 1].fd = -1;
+		}
+		for(i = 0; joined > i; i++) {
+			pfds[i].fd = layers[i].fd;
+			pfds[i].events = POLLIN;
+		}
+		// wake up now and then to see if the layers changed
+		if(poll(pfds, joined, LAYER_CHECK_USEC / 1000) == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			err(1, "poll");
+		}
+		for(i = 0; joined > i; i++) {
+			if(!(pfds[i].revents & POLLIN)) {
+				continue;
+			}
+			for(round = 0; RECV_ROUNDS > round; round++) {
+				if(queue_space(&rx_queue) == 0) {
+					rx_queue.waits++;
+					while(queue_space(&rx_queue) == 0) {
+						usleep(QUEUE_FULL_USEC);
+					}
+				}
+				slot = rx_queue.head % rx_queue.size;
+				// up to the end of the ring
+				n = MIN(MIN(queue_space(&rx_queue), rx_queue.size - slot), RECV_BATCH);
+				if((n = rx_batch(i, slot, n)) > 0) {
+#ifdef COMPRESSION
+					queue_push(&rx_queue, n - rx_decompress(slot, n));
+#else
+					queue_push(&rx_queue, n);
+#endif
+					wake_main();
+				}
+				if(RECV_BATCH > n) {
+					break;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+// Starts the other threads, which leave the signals to the main thread
+void
+pipeline_start() {
+	pthread_t thread;
+	sigset_t set, old;
+	int i;
+
+	for(i = 0; PIPELINE_BUFFERS > i; i++) {
+		if((buffers[i] = calloc(1, sizeof(struct extent))) == NULL
+		 || posix_memalign((void **)&buffers[i]->data, DIRECT_ALIGN, WB_PACKETS * FBP_PACKET_DATASIZE) != 0) {
+			err(1, "posix_memalign() (write-back buffers)");
+		}
+		buffers[i]->first = -1;
+	}
+	free_buffers = PIPELINE_BUFFERS;
+	if(pipe(wakefd) == -1) {
+		err(1, "pipe");
+	}
+	if(fcntl(wakefd[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(wakefd[1], F_SETFL, O_NONBLOCK) == -1) {
+		err(1, "fcntl");
+	}
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if((errno = pthread_create(&thread, NULL, rx_thread, NULL)) != 0
+	 || (errno = pthread_create(&thread, NULL, writer_thread, NULL)) != 0
+	 || (errno = pthread_create(&thread, NULL, verifier_thread, NULL)) != 0
+	 || (stream_fd != -1 && (errno = pthread_create(&streamer, NULL, stream_thread, NULL)) != 0)) {
+		err(1, "pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void
+join_layer() {
+	layers[subscribed].synced = 0;
+	printf("join_layer(): Joining layer %d\n", subscribed);
+	__atomic_store_n(&subscribed, subscribed + 1, __ATOMIC_RELEASE);
+}
+
+void
+leave_layer() {
+	__atomic_store_n(&subscribed, subscribed - 1, __ATOMIC_RELEASE);
+	printf("leave_layer(): Leaving layer %d\n", subscribed);
+}
+
+// Counts the packets we missed on a layer, going by its sequence numbers
+void
+count_layer(int l, unsigned char seq) {
+	struct layer *ly = &layers[l];
+	unsigned char gap = seq - ly->next;
+
+	if(ly->synced && gap >= 128) {
+		// duplicate or reordered, or unicast to us
+		return;
+	}
+	if(ly->synced) {
+		ly->lost += gap;
+	}
+	ly->synced = 1;
+	ly->next = seq + 1;
+	ly->got++;
+}
+
+void
+check_layers(struct timeval *now) {
+	long got = 0, lost = 0, permille;
+	int i;
+
+	if(!TIMEVAL_IS_ZERO(next_check) && !IS_PAST(*now, next_check)) {
+		return;
+	}
+	next_check = *now;
+	TIMEVAL_ADD_USEC(next_check, LAYER_CHECK_USEC);
+	for(i = 0; subscribed > i; i++) {
+		got += layers[i].got;
+		lost += layers[i].lost;
+	}
+	if(got + lost < LAYER_MIN_SAMPLES) {
+		return;
+	}
+	for(i = 0; subscribed > i; i++) {
+		layers[i].got = layers[i].lost = 0;
+	}
+	permille = lost * 1000 / (got + lost);
+	if(permille > LAYER_DROP_PERMILLE && subscribed > 1) {
+		printf("check_layers(): Lost %ld.%ld%% of packets\n", permille / 10, permille % 10);
+		leave_layer();
+		join_usec = MIN(join_usec * 2, LAYER_MAX_JOIN_USEC);
+		next_join = *now;
+		TIMEVAL_ADD_USEC(next_join, join_usec);
+	} else if(permille < LAYER_JOIN_PERMILLE && subscribed < MIN(numlayers, max_layers) && !IS_PAST(next_join, *now)) {
+		join_layer();
+		next_join = *now;
+		TIMEVAL_ADD_USEC(next_join, join_usec);
+	}
+}
+
+void
+print_stats() {
+	struct queue *queues[] = { &rx_queue, &write_queue, &verify_queue, &done_queue,
+#ifdef COMPRESSION
+		&unz_queue,
+#endif
+	};
+	int i;
+	if(rx_calls > 0) {
+		printf("Received %ld datagrams in %ld calls, %.1f per call and at most %ld\n", rx_datagrams, rx_calls, (double)rx_datagrams / rx_calls, rx_most);
+		if(rx_buffers != rx_datagrams) {
+			printf("GRO merged them into %ld buffers\n", rx_buffers);
+		}
+	}
+	for(i = 0; sizeof(queues) / sizeof(queues[0]) > i; i++) {
+		printf("Queue %s holds %u of %u, held at most %u, was full %ld times\n", queues[i]->name,
+			__atomic_load_n(&queues[i]->head, __ATOMIC_RELAXED) - __atomic_load_n(&queues[i]->tail, __ATOMIC_RELAXED), queues[i]->size, queues[i]->deepest, queues[i]->waits);
+	}
+	printf("Waited %ld times for a free write-back buffer, %d of %d free\n", buffer_waits, free_buffers, PIPELINE_BUFFERS);
+	if(stream_fd != -1) {
+		printf("Streamed %lld of %lld bytes to stdout\n", (long long)__atomic_load_n(&streamed, __ATOMIC_RELAXED), (long long)__atomic_load_n(&stream_avail, __ATOMIC_RELAXED));
+	}
+	for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+		if(transfers[i] != NULL) {
+			printf("[%d] Received %ld data packets, %ld of which we already had\n", i, transfers[i]->received, transfers[i]->unneeded);
+			printf("[%d] Received %ld kB of data as %ld kB on the wire\n", i, transfers[i]->data_bytes / 1024, transfers[i]->wire_bytes / 1024);
+			if(peer_pps > 0) {
+				printf("[%d] Peers repaired %ld packets for us, we repaired %ld for them\n", i, transfers[i]->from_peers, transfers[i]->repaired);
+			}
+			if(rfd != -1) {
+				printf("[%d] Relayed %ld data packets\n", i, transfers[i]->relayed);
+			}
+			if(transfers[i]->gap_nacked > 0) {
+				printf("[%d] NACKed %ld packets mid-sweep\n", i, transfers[i]->gap_nacked);
+			}
+			if(transfers[i]->seeded > 0) {
+				printf("[%d] Copied %ld packets from the seed\n", i, transfers[i]->seeded);
+			}
+			if(transfers[i]->zeroed > 0) {
+				printf((direct_path != NULL) ? "[%d] Wrote %ld zero packets without receiving them\n" : "[%d] Left %ld zero packets as holes\n", i, transfers[i]->zeroed);
+			}
+			if(transfers[i]->writes > 0) {
+				printf("[%d] Wrote %ld packets in %ld writes, synced %ld times\n", i, transfers[i]->written, transfers[i]->writes, transfers[i]->syncs);
+			}
+		}
+	}
+}
+
+void
+handle_signal(int sig) {
+	int saved_errno = errno;
+	if(sig == SIGUSR1) {
+		stats = 1;
+	} else {
+		quit = 1;
+	}
+	// The signal may come in while we're not in select(), so make it return
+	if(write(wakefd[1], "", 1) == -1) {
+		// the pipe is full, it returns anyway
+	}
+	errno = saved_errno;
+}
+
+// Handles one datagram that came in on layer l
+void
+handle_datagram(int l, char *buf, ssize_t len, struct sockaddr_in *raddr, socklen_t raddrlen) {
+	if(len < 2 || (rfd != -1 && raddr->sin_port == relay_port)) {
+		// runt, or our own relayed broadcast
+		return;
+	}
+
+	if(buf[0] == 0 && (buf[1] == FBP_NACK_NOTICE || buf[1] == FBP_PEER_REQUEST)) {
+		handle_nacknotice((struct NackNotice *)buf, len);
+	} else if(buf[0] == 0 && buf[1] == FBP_ZERO_MAP) {
+		handle_zeromap((struct ZeroMap *)buf, len);
+	} else if(buf[0] == 0 && buf[1] == FBP_HASH_PAGE) {
+		handle_hashpage((struct HashPage *)buf, len);
+	} else if(buf[0] == 0) {
+		handle_announcement((struct Announcement *)buf, len, raddr, raddrlen);
+	} else {
+		int from_peer = (raddr->sin_port == htons(FBP_DEFAULT_PORT));
+		if(!from_peer) {
+			count_layer(l, ((struct DataPacket *)buf)->seq);
+		}
+		if(((struct DataPacket *)buf)->size & FBP_SIZE_COMPRESSED) {
+#ifdef COMPRESSION
+			if(is_compressed(buf, len)) {
+				handle_compressed((struct DataPacket *)buf, len, from_peer);
+			}
+#else
+			static int warned = 0;
+			if(!warned) {
+				printf("Dropping compressed data packets, build with -DCOMPRESSION to receive them\n");
+				warned = 1;
+			}
+#endif
+		} else {
+			handle_datapacket((struct DataPacket *)buf, len, len - (ssize_t)(sizeof(struct DataPacket) - FBP_PACKET_DATASIZE), from_peer);
+		}
+	}
+}
+
+// Handles one datagram of rx, and gives back the slot it was decompressed into
+static inline void
+rx_dispatch(struct rxbuf *rx, char *buf, ssize_t len) {
+	handle_datagram(rx->layer, buf, len, &rx->addr, rx->addrlen);
+#ifdef COMPRESSION
+	if(is_compressed(buf, len)) {
+		queue_pop(&unz_queue, 1);
+	}
+#endif
+}
+
+// Handles what the receive thread queued, up to RECV_ROUNDS batches of it
+void
+rx_handle() {
+	unsigned int i, n = MIN(queue_depth(&rx_queue), RECV_BATCH * RECV_ROUNDS);
+	struct rxbuf *rx;
+	ssize_t off;
+
+	for(i = 0; n > i; i++) {
+		rx = &rxbufs[(rx_queue.tail + i) % rx_queue.size];
+		if(rx->segsize == 0) {
+			rx_dispatch(rx, rx->data, rx->len);
+			continue;
+		}
+		for(off = 0; rx->len > off; off += rx->segsize) {
+			rx_dispatch(rx, rx->data + off, MIN(rx->segsize, rx->len - off));
+		}
+	}
+	queue_pop(&rx_queue, n);
+}
+
+void
+usage(char *progname) {
+	fprintf(stderr, "Usage: %s [-b 192.168.0.255] [-d 20] [-g] [-l 8] [-o /dev/sdX | -] [-r 0] [-R 10.0.1.255 [-p 10000]] [-s seeddir] [-S 1000]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv) {
+	char ch;
+	char *bcast_addr = "127.0.0.1";
+	char *relay_addr = NULL;
+
+	assert((1 >> 1) == 0 /* require little endian */);
+
+	while((ch = getopt(argc, argv, "b:d:gl:o:p:r:R:s:S:")) != -1) {
+		switch(ch) {
+			case 'b':
+				bcast_addr = optarg;
+				break;
+			case 'd':
+				backoff_usec = strtol(optarg, (char **)NULL, 10) * 1000;
+				if(backoff_usec < 0 || backoff_usec > 10000000) {
+					fprintf(stderr, "%s: request backoff must be between 0 and 10000 ms\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
+			case 'g':
+				use_gro = 1;
+				break;
+			case 'l':
+				max_layers = strtol(optarg, (char **)NULL, 10);
+				if(max_layers < 1 || max_layers > FBP_MAX_LAYERS) {
+					fprintf(stderr, "%s: number of layers must be between 1 and %d\n", argv[0], FBP_MAX_LAYERS);
+					usage(argv[0]);
+				}
+				break;
+			case 'o':
+				if(strcmp(optarg, "-") == 0) {
+					stream_fd = STDOUT_FILENO;
+				} else {
+					direct_path = optarg;
+				}
+				break;
+			case 'p':
+				relay_pps = strtol(optarg, (char **)NULL, 10);
+				if(relay_pps < 1 || relay_pps >= 1000000) {
+					fprintf(stderr, "%s: relay rate must be between 1 and 1000000\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
+			case 'R':
+				relay_addr = optarg;
+				break;
+			case 's':
+				seed_dir = optarg;
+				break;
+			case 'S':
+				sync_usec = strtol(optarg, (char **)NULL, 10) * 1000;
+				if(sync_usec < 0 || sync_usec > 3600000000L) {
+					fprintf(stderr, "%s: sync interval must be between 0 and 3600000 ms\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
+			case 'r':
+				peer_pps = strtol(optarg, (char **)NULL, 10);
+				if(peer_pps < 0 || peer_pps >= 1000000) {
+					fprintf(stderr, "%s: peer repair rate must be between 0 and 1000000\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(argc != optind) {
+		usage(argv[0]);
+	}
+	if(stream_fd != -1 && direct_path != NULL) {
+		fprintf(stderr, "%s: can't both stream and image\n", argv[0]);
+		usage(argv[0]);
+	}
+	if(stream_fd != -1 && ((stream_fd = dup(STDOUT_FILENO)) == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)) {
+		// stdout is for the data now, the messages go with the errors
+		err(1, "dup");
+	}
+
+	bzero(&transfers, sizeof(transfers));
+	srandom(getpid() ^ time(NULL));
+
+	bzero(&group, sizeof(group));
+	group.sin_family = AF_INET;
+	group.sin_addr.s_addr = inet_addr(bcast_addr);
+	group.sin_port = htons(FBP_DEFAULT_PORT);
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(FBP_DEFAULT_PORT);
+	addrlen = sizeof(addr);
+
+	if((sfd = socket(addr.sin_family, SOCK_DGRAM, 0)) == -1) {
+		err(1, "socket");
+	}
+
+	if(bind(sfd, (struct sockaddr *)&addr, addrlen) == -1) {
+		err(1, "bind");
+	}
+
+	int opt = 1;
+	if(setsockopt(sfd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt)) == -1) {
+		err(1, "setsockopt");
+	}
+	layers[0].fd = sfd;
+	rx_init();
+	rx_setup(sfd);
+	pipeline_start();
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGUSR1, handle_signal);
+
+	if(relay_addr != NULL) {
+		struct sockaddr_in raddr = addr;
+		socklen_t raddrlen = sizeof(raddr);
+
+		bzero(&relay_group, sizeof(relay_group));
+		relay_group.sin_family = AF_INET;
+		relay_group.sin_addr.s_addr = inet_addr(relay_addr);
+		relay_group.sin_port = htons(FBP_DEFAULT_PORT);
+
+		if((rfd = socket(addr.sin_family, SOCK_DGRAM, 0)) == -1) {
+			err(1, "socket");
+		}
+		raddr.sin_port = 0;
+		if(bind(rfd, (struct sockaddr *)&raddr, raddrlen) == -1) {
+			err(1, "bind");
+		}
+		if(getsockname(rfd, (struct sockaddr *)&raddr, &raddrlen) == -1) {
+			err(1, "getsockname");
+		}
+		relay_port = raddr.sin_port;
+		if(setsockopt(rfd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt)) == -1) {
+			err(1, "setsockopt");
+		}
+	}
+
+	while(1) {
+		struct timeval now, tmo;
+		long wait = -1;
+		fd_set rfds;
+		char buf[256];
+		int i, n, maxfd;
+
+		// Sleep until a packet comes in, or the first backoff ends
+		gettimeofday(&now, NULL);
+		send_pending_requests(&now);
+		send_repairs(&now);
+		send_gap_nacks(&now);
+		stream_urge(&wait, &now);
+		if(rfd != -1) {
+			relay_send(&now);
+			wait_until(&wait, &relay_announce_at, &now);
+		}
+		wb_flush_cold(&wait, &now);
+		resume_sync_due(&wait, &now);
+		if(numlayers > 1) {
+			check_layers(&now);
+			wait = MIN((wait == -1) ? LAYER_CHECK_USEC : wait, LAYER_CHECK_USEC);
+		}
+		for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+			if(transfers[i] == NULL) {
+				continue;
+			}
+			wait_until(&wait, &transfers[i]->request_at, &now);
+			wait_until(&wait, &transfers[i]->peers_until, &now);
+			wait_until(&wait, &transfers[i]->repair_at, &now);
+			wait_until(&wait, &transfers[i]->gap_at, &now);
+			if(rfd != -1 && transfers[i]->relay_queued > 0) {
+				wait_until(&wait, &relay_at, &now);
+			}
+		}
+		if(queue_depth(&rx_queue) > 0) {
+			// more came in than we handled last time
+			wait = 0;
+		}
+		TIMEVAL_SET(tmo, wait / 1000000, wait % 1000000);
+
+		FD_ZERO(&rfds);
+		FD_SET(wakefd[0], &rfds);
+		maxfd = wakefd[0];
+		if(rfd != -1) {
+			FD_SET(rfd, &rfds);
+			maxfd = MAX(maxfd, rfd);
+		}
+		if((n = select(maxfd+1, &rfds, NULL, NULL, (wait == -1) ? NULL : &tmo)) == -1) {
+			if(errno != EINTR) {
+				err(1, "select");
+			}
+			n = 0;
+		}
+		if(quit) {
+			for(i = 0; sizeof(transfers) / sizeof(transfers[0]) > i; i++) {
+				if(transfers[i] != NULL && transfers[i]->fd != -1) {
+					wb_flush_all(transfers[i]);
+					resume_sync(transfers[i]);
+				}
+			}
+			print_stats();
+			return 0;
+		}
+		if(stats) {
+			stats = 0;
+			print_stats();
+		}
+
+		if(n > 0 && FD_ISSET(wakefd[0], &rfds)) {
+			while(read(wakefd[0], buf, sizeof(buf)) > 0);
+		}
+		if(n > 0 && rfd != -1 && FD_ISSET(rfd, &rfds)) {
+			relay_receive();
 		}
+		pipeline_poll();
+		rx_handle();
 	}
 
 	return 0;
@@ -7,10 +7,15 @@ typedef int bm_bitid;
 #define BM_SIZE(numbits)    BM_UNITS(numbits)*sizeof(bm_datatype)
 // Cast is necessary to make the C++ compiler happy
 #define BM_INIT(m, numbits) m = (bm_datatype*)calloc(BM_UNITS(numbits), sizeof(bm_datatype))
-#define BM_SET(m, n)        m[n/BM_BITS_PER_UNIT] |= (1 << (n % BM_BITS_PER_UNIT))
-#define BM_CLR(m, n)        m[n/BM_BITS_PER_UNIT] &= ~(1 << (n % BM_BITS_PER_UNIT))
-#define BM_ISSET(m, n)      ((m[n/BM_BITS_PER_UNIT] & (1 << (n % BM_BITS_PER_UNIT))) != 0)
+// Extends m from oldbits to newbits bits, the new ones are clear
+#define BM_GROW(m, oldbits, newbits) do { m = (bm_datatype*)realloc(m, BM_SIZE(newbits)); memset(&(m)[BM_UNITS(oldbits)], 0, BM_SIZE(newbits) - BM_SIZE(oldbits)); } while(0)
+#define BM_SET(m, n)        (m)[(n)/BM_BITS_PER_UNIT] |= (1 << ((n) % BM_BITS_PER_UNIT))
+#define BM_CLR(m, n)        (m)[(n)/BM_BITS_PER_UNIT] &= ~(1 << ((n) % BM_BITS_PER_UNIT))
+#define BM_ISSET(m, n)      (((m)[(n)/BM_BITS_PER_UNIT] & (1 << ((n) % BM_BITS_PER_UNIT))) != 0)
 #define BM_FREE(m)          free(m)
+// For bitmasks that another thread sets or reads at the same time
+#define BM_SET_ATOMIC(m, n)   __atomic_fetch_or(&(m)[(n)/BM_BITS_PER_UNIT], 1 << ((n) % BM_BITS_PER_UNIT), __ATOMIC_RELEASE)
+#define BM_ISSET_ATOMIC(m, n) ((__atomic_load_n(&(m)[(n)/BM_BITS_PER_UNIT], __ATOMIC_ACQUIRE) & (1 << ((n) % BM_BITS_PER_UNIT))) != 0)
 
 static inline bm_bitid
 bm_find_setbit(bm_datatype *m, bm_bitid numbits, bm_bitid offset) {
@@ -2,13 +2,35 @@
 #define FBP_GLOBAL_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 #define FBP_DEFAULT_PORT        1026
 #define FBP_PACKET_DATASIZE     1024
 #define FBP_ANNOUNCE_VERSION    2
+#define FBP_NACK_NOTICE         0x40
+#define FBP_PEER_REQUEST        0x41 // a NackNotice the server never got: receivers holding the data may answer
+#define FBP_ZERO_MAP            0x42 // see struct ZeroMap
+#define FBP_HASH_REQUEST        0x43 // see struct HashRequest
+#define FBP_HASH_PAGE           0x44 // see struct HashPage
 #define FBP_STATUS_WAITING      0
 #define FBP_STATUS_TRANSFERRING 1
+#define FBP_FLAG_UNICAST        0x01 // server may unicast repairs to the receivers that asked
+#define FBP_FLAG_OPEN           0x02 // file is still growing: numPackets may go up, checksum isn't known yet
+#define FBP_FLAG_COMPRESSED     0x04 // data packets may be compressed, receivers must understand FBP_SIZE_COMPRESSED
+#define FBP_FLAG_HASHES         0x08 // server answers HashRequests
+#define FBP_SIZE_COMPRESSED     0x8000 // DataPacket.size flag: data is a zstd frame of the packets from offset on
+#define FBP_COMPRESS_GROUP      8    // most packets one compressed DataPacket holds, aligned to their number
 #define FBP_REQUESTS_PER_PACKET 30
+#define FBP_REQUEST_BITMAP      -1
+#define FBP_REQUEST_URGENT      -2   // offset of the last range of a RequestPacket: send its packets before the rest of the queue
+#define FBP_BITMAP_PACKETS      (FBP_PACKET_DATASIZE * 8)
+#define FBP_MAX_LAYERS          8    // layer n is sent to FBP_DEFAULT_PORT + n
+#define FBP_MAX_SERVERS         16
+#define FBP_SHARE_PACKETS       1024 // servers of one file split it in shares of this many packets
+#define FBP_HASH_BLOCK          64   // packets per block we publish a hash of
+#define FBP_HASH_SIZE           8    // bytes of a block's SHA1 we publish
+#define FBP_HASHES_PER_PAGE     (FBP_PACKET_DATASIZE / FBP_HASH_SIZE)
 
 typedef int32_t pkt_count;
 
@@ -21,6 +43,10 @@ struct Announcement
   pkt_count numPackets; // 4 bytes: number of packets
   char filename[256];   // 256 bytes of filename
   char checksum[40];    // complete SHA1 checksum of the file
+  unsigned char flags;  // FBP_FLAG_*, zero if the announcement is shorter
+  unsigned char numLayers; // data is spread over this many ports, 0 means 1
+  unsigned char serverIndex; // this server owns share n if n % serverCount == serverIndex
+  unsigned char serverCount; // servers announcing this checksum, 0 means 1
 } __attribute__((__packed__));
 
 struct _requestData {
@@ -34,15 +60,66 @@ struct RequestPacket
 	struct _requestData requests[FBP_REQUESTS_PER_PACKET];
 } __attribute__((__packed__));
 
+// Alternative to a RequestPacket for windows with many small gaps
+struct BitmapRequestPacket
+{
+  unsigned char fileid;          // ID of the file (must be > 0)
+  pkt_count marker;              // ALWAYS FBP_REQUEST_BITMAP (where a RequestPacket has its first offset)
+  pkt_count offset;              // first packet of the window, multiple of FBP_BITMAP_PACKETS
+  uint32_t bits[FBP_BITMAP_PACKETS / 32]; // bit n set means we want packet offset + n
+} __attribute__((__packed__));
+
+// A copy of a request, sent to the group so other receivers can hold back theirs
+struct NackNotice
+{
+  char zero;            // ALWAYS 0, like an announcement
+  char announceVer;     // ALWAYS FBP_NACK_NOTICE
+  union {
+    struct RequestPacket ranges;
+    struct BitmapRequestPacket bitmap;
+  } request;            // the request as it was sent to the server
+} __attribute__((__packed__));
+
+// Sent instead of data packets that are all zero; receivers leave them as holes
+struct ZeroMap
+{
+  char zero;            // ALWAYS 0, like an announcement
+  char announceVer;     // ALWAYS FBP_ZERO_MAP
+  struct RequestPacket ranges; // the packets that are all zero, unused ranges are left off
+} __attribute__((__packed__));
+
+// Asks a server for the block hashes of a file, to copy what didn't change from an older version
+struct HashRequest
+{
+  char zero;            // ALWAYS 0, where a request has its file ID
+  char announceVer;     // ALWAYS FBP_HASH_REQUEST
+  unsigned char fileid; // ID of the file (must be > 0)
+  pkt_count first;      // first page we want
+  pkt_count num;        // number of pages we want
+} __attribute__((__packed__));
+
+// Hashes of FBP_HASHES_PER_PAGE blocks; the last page of a file is shorter
+struct HashPage
+{
+  char zero;            // ALWAYS 0, like an announcement
+  char announceVer;     // ALWAYS FBP_HASH_PAGE
+  unsigned char fileid; // ID of the file (must be > 0)
+  pkt_count page;       // hashes[0] is of block page * FBP_HASHES_PER_PAGE
+  unsigned char hashes[FBP_HASHES_PER_PAGE][FBP_HASH_SIZE]; // of each block's data, up to the end of the file
+} __attribute__((__packed__));
+
 struct DataPacket
 {
   unsigned char fileid; // ID of the file (must be > 0)
-  char unused1;         // unused
-  unsigned short size;  // size of the data, excluding header (8 bytes)
+  unsigned char seq;    // counts packets per layer, so receivers can tell their loss rate
+  unsigned short size;  // size of the data, excluding header (8 bytes), may have FBP_SIZE_COMPRESSED set
   pkt_count offset;     // offset number of this packet
   char data[FBP_PACKET_DATASIZE]; // the actual data
 } __attribute__((__packed__));
 
+void sha1_hex(char *, const unsigned char *);
 void sha1_file(char *, int);
+void sha1_range(char *, int, off_t);
+void sha1_block(unsigned char *, const void *, size_t);
 
 #endif // FBP_GLOBAL_H
@@ -10,14 +10,33 @@
 #include <sys/mman.h>
 #endif
 #include <sys/uio.h>
+#include <string.h>
+#include "fbp.h"
+
+// Writes a 20 byte digest as 40 hex digits
+void
+sha1_hex(char *out, const unsigned char *digest) {
+	static const char hex[]="0123456789abcdef";
+	int i;
+	for(i = 0; 20 > i; i++) {
+		out[i*2] = hex[digest[i] >> 4];
+		out[i*2+1] = hex[digest[i] & 0x0f];
+	}
+}
+
+// Writes the first FBP_HASH_SIZE bytes of the SHA1 of a block
+void
+sha1_block(unsigned char *out, const void *buf, size_t len) {
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1(buf, len, digest);
+	memcpy(out, digest, FBP_HASH_SIZE);
+}
 
 void
 sha1_file(char *out, int fd) {
 	SHA_CTX c;
 	unsigned char buf[BUFSIZ];
 	ssize_t len;
-	static const char hex[]="0123456789abcdef";
-	int i;
 #ifdef HAS_MMAP
 	struct stat st;
 #endif
@@ -68,8 +87,36 @@ done:
 		errno = 0;
 		err(1, "SHA1_Final() failed; possible cause");
 	}
-	for(i = 0; 20 > i; i++) {
-		out[i*2] = hex[buf[i] >> 4];
-		out[i*2+1] = hex[buf[i] & 0x0f];
+	sha1_hex(out, buf);
+}
+
+// Like sha1_file(), but of the first len bytes of fd only, say of a disk we imaged
+void
+sha1_range(char *out, int fd, off_t len) {
+	SHA_CTX c;
+	unsigned char buf[64 * 1024];
+	off_t off;
+	ssize_t res;
+
+	if(SHA1_Init(&c) == 0) {
+		errno = 0;
+		err(1, "SHA1_Init() failed; possible cause");
+	}
+	for(off = 0; len > off; off += res) {
+		if((res = pread(fd, buf, (len - off > (off_t)sizeof(buf)) ? sizeof(buf) : len - off, off)) == -1) {
+			err(1, "pread");
+		}
+		if(res == 0) {
+			break;
+		}
+		if(SHA1_Update(&c, buf, res) == 0) {
+			errno = 0;
+			err(1, "SHA1_Update() failed; possible cause");
+		}
+	}
+	if(SHA1_Final(buf, &c) == 0) {
+		errno = 0;
+		err(1, "SHA1_Final() failed; possible cause");
 	}
+	sha1_hex(out, buf);
 }
@@ -1,13 +1,46 @@
 #include "fbpclient.h"
 #include "../common/fbp.h"
+#include <QCryptographicHash>
 #include <QDateTime>
+#include <climits>
 #include "receiverthread.h"
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
+// Maximum random delay before we send our requests
+#define REQUEST_BACKOFF_MSEC 20
+
+// Endgame: once we miss no more than ENDGAME_PACKETS packets, we ask for
+// them on every announcement, also while the servers are still busy, and
+// without the random delay; fbpd -e sends rounds this small several times
+#define ENDGAME_PACKETS 64
+
+// A server that hasn't announced for this long is considered gone
+#define SERVER_TIMEOUT_SEC 3
+
+// Most packets a data packet past the end of an open file may grow it by;
+// larger growth waits for the next announcement
+#define GROW_WINDOW 65536
+
+// Peer repair: before asking the servers, we ask the other receivers for
+// what we're missing, and answer their requests from our data file at no
+// more than PEER_REPAIR_PPS packets per second. 0 disables peer repair.
+#ifndef PEER_REPAIR_PPS
+#define PEER_REPAIR_PPS 0
+#endif
+#define PEER_BACKOFF_MSEC     10
+#define PEER_IDLE_MSEC        50
+#define PEER_REPAIR_TICK_MSEC 10
+#define PEERS                 FBP_MAX_SERVERS // sendRequestDatagram() target for the peers
 
 FbpClient::FbpClient(quint16 port, QObject *parent)
 : QObject(parent)
 , thread_( new ReceiverThread(port, this) )
 , knownFileClearTimer_( new QTimer() )
 , updateInterfaceTimer_( new QTimer() )
+, requestTimer_( new QTimer() )
+, repairTimer_( new QTimer() )
 {
   // If this is a big-endian system, crash
   Q_ASSERT((1 >> 1) == 0);
@@ -16,6 +49,12 @@ FbpClient::FbpClient(quint16 port, QObject *parent)
            this,    SLOT(announcementReceived(Announcement*, QString, quint16)));
   connect( thread_, SIGNAL(gotDataPacket(DataPacket*)),
            this,    SLOT(readDataPacket(DataPacket*)));
+  connect( thread_, SIGNAL(gotNackNotice(NackNotice*, qint64)),
+           this,    SLOT(nackNoticeReceived(NackNotice*, qint64)));
+  connect( thread_, SIGNAL(gotZeroMap(ZeroMap*, qint64)),
+           this,    SLOT(zeroMapReceived(ZeroMap*, qint64)));
+  connect( thread_, SIGNAL(gotHashPage(HashPage*, qint64)),
+           this,    SLOT(hashPageReceived(HashPage*, qint64)));
   connect( this,    SIGNAL(sendDatagram(const char*,qint64,QString,quint16)),
             thread_,SLOT(sendDatagram(const char*,qint64,QString,quint16)));
 
@@ -23,6 +62,8 @@ FbpClient::FbpClient(quint16 port, QObject *parent)
            this,                 SLOT(   clearKnownFiles() ) );
   connect( updateInterfaceTimer_, SIGNAL(        timeout() ),
            this,                  SLOT(  updateInterface() ) );
+  connect( requestTimer_,         SIGNAL(            timeout() ),
+           this,                  SLOT(  sendPendingRequests() ) );
 
   knownFileClearTimer_->setSingleShot( false );
   knownFileClearTimer_->setInterval( 5000 );
@@ -31,6 +72,11 @@ FbpClient::FbpClient(quint16 port, QObject *parent)
   updateInterfaceTimer_->setSingleShot( false );
   updateInterfaceTimer_->setInterval( 200 );
   updateInterfaceTimer_->start();
+
+  requestTimer_->setSingleShot( true );
+
+  connect( repairTimer_, SIGNAL(     timeout() ),
+           this,         SLOT(   sendRepairs() ) );
 }
 
 FbpClient::~FbpClient()
@@ -70,6 +116,8 @@ void FbpClient::finishDownload( int id )
   downloadingFilesMutex_.unlock();
 
   qDebug() << "finishDownload for" << id;
+  qDebug() << "Received" << thread_->dataBytes() / 1024 << "kB of data as"
+           << thread_->wireBytes() / 1024 << "kB on the wire so far";
   emit fileProgressChanged( id, 100 );
 
   int index = -1;
@@ -156,7 +204,7 @@ bool FbpClient::isDownloadingFile( int id )
 
 int FbpClient::progressFromBitmask( const struct KnownFile *k ) const
 {
-  if( !k->bitmask )
+  if( !k->bitmask || k->numPackets == 0 )
     return 0;
 
   double numPackets = (double)k->numPackets;
@@ -198,9 +246,22 @@ void FbpClient::announcementReceived( struct Announcement *a, QString sender, qu
     k->fileName   = QString( a->filename );
     k->id         = id;
     k->numPackets = a->numPackets;
-    k->server     = sender;
-    k->serverPort = port;
+    k->serverCount = qMax( 1, (int)a->serverCount );
     k->bitmask    = 0;
+    k->heard      = 0;
+    k->repair     = 0;
+    k->repairNext = 0;
+    k->unicast    = false;
+    k->open       = ( a->flags & FBP_FLAG_OPEN ) != 0;
+    k->hashes     = ( a->flags & FBP_FLAG_HASHES ) != 0;
+    k->seed       = 0;
+    k->hashed     = 0;
+    memcpy( k->checksum, a->checksum, sizeof(k->checksum) );
+    for( int i = 0; i < FBP_MAX_SERVERS; ++i )
+    {
+      k->servers[i].port    = 0;
+      k->servers[i].waiting = false;
+    }
     knownFiles_.append( k );
     index         = knownFiles_.size()-1;
 
@@ -210,6 +271,10 @@ void FbpClient::announcementReceived( struct Announcement *a, QString sender, qu
   // Got an announcement for an existing file
   knownFiles_[index]->lastAnnouncement = QDateTime::currentDateTime().toTime_t();
 
+  // A file that's still open may have grown since
+  if( knownFiles_[index]->open && a->numPackets > knownFiles_[index]->numPackets )
+    growFile( knownFiles_[index], a->numPackets );
+
   if( knownFiles_[index]->numPackets != a->numPackets )
   {
     qWarning() << "Warning: Invalid announcement: Number of packets for this "
@@ -219,27 +284,379 @@ void FbpClient::announcementReceived( struct Announcement *a, QString sender, qu
     clearKnownFiles();
     goto endparse;
   }
-  if( knownFiles_[index]->server != sender
-   || knownFiles_[index]->serverPort != port )
+
+  // Several servers may announce the same file, as long as they agree on
+  // what it is and how they share it
+  if( ( !knownFiles_[index]->open
+       && memcmp( knownFiles_[index]->checksum, a->checksum, sizeof(a->checksum) ) != 0 )
+   || knownFiles_[index]->serverCount != qMax( 1, (int)a->serverCount )
+   || a->serverIndex >= knownFiles_[index]->serverCount )
   {
     qWarning() << "Warning: Invalid announcement: Different server hosting "
-                  "overlapping ID or other port used.";
+                  "overlapping ID with another file.";
     knownFiles_[index]->lastAnnouncement = 0;
     clearKnownFiles();
     goto endparse;
   }
 
+  {
+    struct Server *server = &knownFiles_[index]->servers[(int)a->serverIndex];
+    server->host             = sender;
+    server->port             = port;
+    server->lastAnnouncement = QDateTime::currentDateTime();
+    server->waiting          = a->status == FBP_STATUS_WAITING;
+  }
+
+  // If the server unicasts repairs, what others request won't reach us, so
+  // we can't leave it out of our own requests
+  knownFiles_[index]->unicast = ( a->flags & FBP_FLAG_UNICAST ) != 0;
+
+  // Once the file is complete, we know what it should hash to
+  if( knownFiles_[index]->open && !( a->flags & FBP_FLAG_OPEN ) )
+  {
+    qDebug() << "File with ID" << (int)id << "is complete at"
+             << a->numPackets << "packets";
+    memcpy( knownFiles_[index]->checksum, a->checksum, sizeof(a->checksum) );
+    knownFiles_[index]->open = false;
+  }
+
+  // Find out what we can copy from the older version before we request
+  // anything
+  if( knownFiles_[index]->seed != 0 )
+  {
+    sendHashRequest( index, a->serverIndex );
+    goto endparse;
+  }
+
   // If we're currently downloading this file and server status is WAITING,
-  // we can request a new range of packets :)
-  if( isDownloadingFile( id ) && a->status == FBP_STATUS_WAITING )
+  // we can request a new range of packets :) We wait a random time first, so
+  // we can leave out whatever other receivers request in the meantime. In
+  // the endgame we ask right away, whatever the status.
+  if( isDownloadingFile( id ) && !pendingRequests_.contains( id )
+   && !askingPeers_.contains( id ) )
   {
-    sendRequest( id );
+    bool endgame = inEndgame( knownFiles_[index] );
+    if( a->status == FBP_STATUS_WAITING || endgame )
+    {
+      memset( knownFiles_[index]->heard, 0, BM_SIZE( knownFiles_[index]->numPackets ) );
+      pendingRequests_.insert( id, QDateTime::currentDateTime().addMSecs(
+                                     endgame ? 0 : qrand() % REQUEST_BACKOFF_MSEC ) );
+      sendPendingRequests();
+    }
   }
 
 endparse:
   delete [] a;
 }
 
+/**
+ * Another receiver sent a request to the server. If we're still waiting to
+ * send ours, mark these packets so we don't request them again. If it asked
+ * the peers instead, we queue whatever of it we have as repairs.
+ */
+void FbpClient::nackNoticeReceived( struct NackNotice *n, qint64 size )
+{
+  int id = (unsigned char)n->request.ranges.fileid;
+  qint64 requestSize = size - ( sizeof(struct NackNotice) - sizeof(n->request) );
+  int index = -1;
+  for( int i = 0; i < knownFiles_.size(); ++i )
+    if( knownFiles_[i]->id == id ) index = i;
+
+  if( index == -1 )
+    goto endparse;
+
+  if( PEER_REPAIR_PPS > 0 && n->announceVer == FBP_PEER_REQUEST
+   && knownFiles_[index]->repair != 0 )
+  {
+    struct KnownFile *k = knownFiles_[index];
+    markRequested( k, k->repair, n, requestSize );
+    for( unsigned int i = 0; i < BM_UNITS( k->numPackets ); ++i )
+      k->repair[i] &= k->bitmask[i];
+
+    // Start somewhere random after a random time, so peers answering the
+    // same request mostly send different packets
+    if( !repairTimer_->isActive() )
+    {
+      k->repairNext = qrand() % qMax( 1, k->numPackets );
+      repairTimer_->start( qrand() % PEER_BACKOFF_MSEC );
+    }
+  }
+
+  if( !pendingRequests_.contains( id ) || knownFiles_[index]->unicast )
+    goto endparse;
+
+  markRequested( knownFiles_[index], knownFiles_[index]->heard, n, requestSize );
+
+endparse:
+  delete [] (char*)n;
+}
+
+/**
+ * The server left out these packets because they're all zero. We mark them
+ * as done and leave them as holes in the data file; the last packet is never
+ * left out, so the file still ends up at the right size.
+ */
+void FbpClient::zeroMapReceived( struct ZeroMap *z, qint64 size )
+{
+  int id = (unsigned char)z->ranges.fileid;
+  int ranges = ( size - (qint64)( sizeof(struct ZeroMap) - sizeof(z->ranges.requests) ) )
+             / (qint64)sizeof(struct _requestData);
+  int index = -1;
+  for( int i = 0; i < knownFiles_.size(); ++i )
+    if( knownFiles_[i]->id == id ) index = i;
+
+  if( index == -1 || !isDownloadingFile( id ) )
+    goto endparse;
+
+  {
+    struct KnownFile *k = knownFiles_[index];
+    for( int i = 0; i < ranges && i < FBP_REQUESTS_PER_PACKET; ++i )
+    {
+      struct _requestData *r = &z->ranges.requests[i];
+      if( r->offset < 0 || r->num < 0 || r->offset + r->num > k->numPackets )
+      {
+        qWarning() << "Zero map for" << id << "is out of range, dropping it";
+        goto endparse;
+      }
+      for( pkt_count n = r->offset; n < r->offset + r->num; ++n )
+      {
+        BM_SET( k->bitmask, n );
+        BM_CLR( k->repair, n );
+      }
+    }
+    flushBitmask( id );
+  }
+
+endparse:
+  delete [] (char*)z;
+}
+
+/**
+ * A server sent the hashes of some blocks. We copy the blocks of the older
+ * version that match into the data file. Once we have seen every page, we're
+ * done with the older version and request the rest as usual.
+ */
+void FbpClient::hashPageReceived( struct HashPage *h, qint64 size )
+{
+  int id = (unsigned char)h->fileid;
+  int hashes = ( size - (qint64)( sizeof(struct HashPage) - sizeof(h->hashes) ) ) / FBP_HASH_SIZE;
+  int index = -1;
+  for( int i = 0; i < knownFiles_.size(); ++i )
+    if( knownFiles_[i]->id == id ) index = i;
+
+  if( index == -1 || !isDownloadingFile( id ) )
+    goto endparse;
+
+  {
+    struct KnownFile *k = knownFiles_[index];
+    if( k->seed == 0 || h->page < 0 || h->page >= k->seedPages
+     || BM_ISSET( k->hashed, h->page ) )
+      goto endparse;
+
+    downloadingFilesMutex_.lock();
+    QFile *dataFile = downloadingFiles_[id].first;
+    downloadingFilesMutex_.unlock();
+
+    char *block = new char[FBP_HASH_BLOCK * FBP_PACKET_DATASIZE];
+    for( int i = 0; i < hashes && i < FBP_HASHES_PER_PAGE; ++i )
+    {
+      pkt_count first = ( h->page * FBP_HASHES_PER_PAGE + i ) * FBP_HASH_BLOCK;
+      if( first >= k->numPackets )
+        break;
+      if( !k->seed->seek( (qint64)first * FBP_PACKET_DATASIZE ) )
+        continue;
+      qint64 len = k->seed->read( block, FBP_HASH_BLOCK * FBP_PACKET_DATASIZE );
+      if( len <= 0 )
+        continue;
+      QByteArray hash = QCryptographicHash::hash( QByteArray::fromRawData( block, len ),
+                                                  QCryptographicHash::Sha1 );
+      if( memcmp( hash.constData(), h->hashes[i], FBP_HASH_SIZE ) != 0 )
+        continue;
+
+      if( !dataFile->seek( (qint64)first * FBP_PACKET_DATASIZE )
+       || dataFile->write( block, len ) != len )
+      {
+        qWarning() << "Couldn't copy block from older version: "
+                   << dataFile->errorString();
+        continue;
+      }
+      for( pkt_count n = first; n < first + ( len + FBP_PACKET_DATASIZE - 1 ) / FBP_PACKET_DATASIZE
+                                && n < k->numPackets; ++n )
+        BM_SET( k->bitmask, n );
+    }
+    delete [] block;
+    BM_SET( k->hashed, h->page );
+
+    if( --k->seedLeft > 0 )
+      goto endparse;
+
+    qDebug() << "Done copying from the older version of" << k->fileName;
+    dataFile->flush();
+    flushBitmask( id );
+    delete k->seed;
+    k->seed = 0;
+    BM_FREE( k->hashed );
+
+    // Ask for the rest right away, instead of at the next announcement
+    if( !pendingRequests_.contains( id ) && !askingPeers_.contains( id ) )
+    {
+      memset( k->heard, 0, BM_SIZE( k->numPackets ) );
+      pendingRequests_.insert( id, QDateTime::currentDateTime().addMSecs(
+                                     qrand() % REQUEST_BACKOFF_MSEC ) );
+      sendPendingRequests();
+    }
+  }
+
+endparse:
+  delete [] (char*)h;
+}
+
+/**
+ * Sets the packets a request asks for in mask. Returns false if the request
+ * is invalid.
+ */
+bool FbpClient::markRequested( const struct KnownFile *f, bm_datatype *mask,
+                               struct NackNotice *n, qint64 size ) const
+{
+  pkt_count numPackets = f->numPackets;
+
+  if( size == (qint64)sizeof(struct BitmapRequestPacket)
+   && n->request.bitmap.marker == FBP_REQUEST_BITMAP )
+  {
+    struct BitmapRequestPacket *bp = &n->request.bitmap;
+    if( bp->offset < 0 || bp->offset % FBP_BITMAP_PACKETS != 0 )
+      return false;
+    for( unsigned int i = 0; i < FBP_BITMAP_PACKETS / BM_BITS_PER_UNIT
+                          && bp->offset + i * BM_BITS_PER_UNIT < (unsigned int)numPackets; ++i )
+      mask[bp->offset / BM_BITS_PER_UNIT + i] |= bp->bits[i];
+  }
+  else if( size == (qint64)sizeof(struct RequestPacket) )
+  {
+    struct RequestPacket *rp = &n->request.ranges;
+    for( int i = 0; i < FBP_REQUESTS_PER_PACKET; ++i )
+    {
+      if( rp->requests[i].offset < 0 || rp->requests[i].num < 0
+       || rp->requests[i].offset + rp->requests[i].num > numPackets )
+        return false;
+      for( pkt_count p = rp->requests[i].offset;
+           p < rp->requests[i].offset + rp->requests[i].num; ++p )
+        BM_SET( mask, p );
+    }
+  }
+  return true;
+}
+
+/**
+ * Sends the requests whose backoff has ended, to the peers first if we do
+ * peer repair, and to the servers once the peers went quiet. Then sets the
+ * timer for the next one.
+ */
+void FbpClient::sendPendingRequests()
+{
+  QDateTime now = QDateTime::currentDateTime();
+  QDateTime next;
+
+  foreach( int id, pendingRequests_.keys() )
+  {
+    if( pendingRequests_[id] <= now )
+    {
+      pendingRequests_.remove( id );
+      sendRequest( id, PEER_REPAIR_PPS > 0 );
+      if( PEER_REPAIR_PPS > 0 && isDownloadingFile( id ) )
+        askingPeers_.insert( id, now.addMSecs( PEER_IDLE_MSEC ) );
+    }
+    else if( next.isNull() || pendingRequests_[id] < next )
+      next = pendingRequests_[id];
+  }
+
+  foreach( int id, askingPeers_.keys() )
+  {
+    if( askingPeers_[id] <= now )
+    {
+      askingPeers_.remove( id );
+      sendRequest( id );
+    }
+    else if( next.isNull() || askingPeers_[id] < next )
+      next = askingPeers_[id];
+  }
+
+  if( !next.isNull() )
+  {
+    int wait = now.msecsTo( next );
+    requestTimer_->start( wait > 0 ? wait : 0 );
+  }
+}
+
+/**
+ * Sends the next few repairs our peers asked for, from our data file.
+ */
+void FbpClient::sendRepairs()
+{
+  int budget = qMax( 1, PEER_REPAIR_PPS * PEER_REPAIR_TICK_MSEC / 1000 );
+  bool more = false;
+
+  foreach( struct KnownFile *k, knownFiles_ )
+  {
+    if( k->repair == 0 )
+      continue;
+
+    QFile *dataFile = 0;
+    QFile finishedFile( k->fileName );
+    downloadingFilesMutex_.lock();
+    if( downloadingFiles_.contains( k->id ) )
+      dataFile = downloadingFiles_[k->id].first;
+    downloadingFilesMutex_.unlock();
+    if( dataFile == 0 )
+    {
+      if( !finishedFile.open( QIODevice::ReadOnly ) )
+      {
+        memset( k->repair, 0, BM_SIZE( k->numPackets ) );
+        continue;
+      }
+      dataFile = &finishedFile;
+    }
+
+    for( pkt_count seen = 0; seen < k->numPackets; ++seen )
+    {
+      pkt_count i = ( k->repairNext + seen ) % k->numPackets;
+      if( !BM_ISSET( k->repair, i ) )
+        continue;
+      if( budget == 0 )
+      {
+        more = true;
+        break;
+      }
+      BM_CLR( k->repair, i );
+      k->repairNext = i + 1;
+
+      // ReceiverThread will delete d
+      struct DataPacket *d = (struct DataPacket*) new char[sizeof(struct DataPacket)];
+      qint64 size = -1;
+      if( dataFile->seek( (qint64)i * FBP_PACKET_DATASIZE ) )
+        size = dataFile->read( d->data, FBP_PACKET_DATASIZE );
+      if( size <= 0 )
+      {
+        qWarning() << "Couldn't read packet" << i << "for a peer:"
+                   << dataFile->errorString();
+        delete [] (char*)d;
+        continue;
+      }
+      d->fileid = k->id;
+      d->seq    = 0;
+      d->size   = size;
+      d->offset = i;
+      emit sendDatagram( (const char*)d, sizeof(struct DataPacket) - FBP_PACKET_DATASIZE + size,
+                         QHostAddress( QHostAddress::Broadcast ).toString(), FBP_DEFAULT_PORT );
+      budget--;
+    }
+  }
+
+  if( more )
+    repairTimer_->start( PEER_REPAIR_TICK_MSEC );
+  else
+    repairTimer_->stop();
+}
+
 void FbpClient::readDataPacket( struct DataPacket *d )
 {
   pkt_count offset = d->offset;
@@ -257,43 +674,47 @@ void FbpClient::readDataPacket( struct DataPacket *d )
 
   numPackets = knownFiles_[index]->numPackets;
 
-  if( offset >= numPackets )
+  // Data past the end of a file that's still open tells us it grew
+  if( knownFiles_[index]->open && offset >= numPackets
+   && d->size == FBP_PACKET_DATASIZE
+   && offset - numPackets < GROW_WINDOW && offset < INT_MAX )
+  {
+    growFile( knownFiles_[index], offset + 1 );
+    numPackets = offset + 1;
+  }
+
+  if( offset < 0 || offset >= numPackets )
   {
-    qWarning() << "Wait, what? Received a data packet with offset larger or "
-                  "equal to packet count. Dropping.";
+    qWarning() << "Wait, what? Received a data packet with offset outside "
+                  "the file. Dropping.";
     goto endparse;
   }
 
+  // Somebody else repaired this one already
+  if( knownFiles_[index]->repair != 0 )
+    BM_CLR( knownFiles_[index]->repair, offset );
+
   if( !BM_ISSET( knownFiles_[index]->bitmask, offset ) )
   {
     // We don't have it!
 
-    // Append zeroes to the file if it's not large enough
+    // The peers are still helping us, keep waiting for them
+    if( askingPeers_.contains( id ) )
+      askingPeers_[id] = QDateTime::currentDateTime().addMSecs( PEER_IDLE_MSEC );
+
+    // Extend the file if it's not large enough; what we skip stays a hole.
+    // Only open files get here, the others are reserved up front.
     downloadingFilesMutex_.lock();
     QFile *dataFile = downloadingFiles_[id].first;
     downloadingFilesMutex_.unlock();
-    int length      = dataFile->size();
-    int data_offset = offset * FBP_PACKET_DATASIZE;
-    int zeroes      = data_offset - length;
+    qint64 length      = dataFile->size();
+    qint64 data_offset = (qint64)offset * FBP_PACKET_DATASIZE;
 
-    if( zeroes > 0 )
+    if( data_offset > length && !dataFile->resize( data_offset ) )
     {
-      if( !dataFile->seek( length ) )
-      {
-        qWarning() << "Failed to seek() to end of file: "
-                   << dataFile->errorString();
-        goto endparse;
-      }
-      char *toWrite = new char[zeroes];
-      for( int i = 0; i < zeroes; ++i )
-        toWrite[i] = '\0';
-      if( dataFile->write( toWrite, zeroes ) != zeroes )
-      {
-        qWarning() << "Failed to write zeroes to data file: "
-                   << dataFile->errorString();
-        goto endparse;
-      }
-      delete [] toWrite;
+      qWarning() << "Failed to extend data file: "
+                 << dataFile->errorString();
+      goto endparse;
     }
 
     // Write the data itself
@@ -331,7 +752,7 @@ endparse:
   delete [] d;
 }
 
-void FbpClient::sendRequest( int id )
+void FbpClient::sendRequest( int id, bool peers )
 {
   if( !isDownloadingFile( id ) )
     return;
@@ -349,79 +770,238 @@ void FbpClient::sendRequest( int id )
     return;
   }
 
-  // First, we should determine what parts of the file we miss
-  long offset  = -1;
-  int  numPackets = 0;
-  int  datagramsSent = 0;
+  struct KnownFile *k = knownFiles_[index];
+  pkt_count totalNum = k->numPackets;
+  pkt_count missing = 0;
+  for( pkt_count i = 0; i < totalNum; ++i )
+    if( !BM_ISSET( k->bitmask, i ) )
+      missing++;
 
-  // This is a very inefficient method, we should use bitwise comparison
-  // of a full byte at once until an unset bit is found. Stuff for later.
-  pkt_count totalNum = knownFiles_[index]->numPackets;
-
-  struct RequestPacket *rp = new struct RequestPacket;
-  rp->fileid = id;
-  int requestNum = 0;
+  // If we have all packages, no request needs to be sent. A file that's
+  // still open isn't finished, though.
+  if( missing == 0 )
+  {
+    if( !k->open )
+      finishDownload( id );
+    return;
+  }
 
-  for( pkt_count i = 0; i <= totalNum; ++i )
+  // Then, we should determine what parts of the file we should ask each
+  // server for. We look at the file in windows of FBP_BITMAP_PACKETS packets,
+  // and for every window send either its missing ranges or a bitmap,
+  // whichever is smaller.
+  routeShares( k );
+  for( int server = peers ? PEERS : 0; server < ( peers ? PEERS + 1 : k->serverCount ); ++server )
   {
-    if( i == totalNum || BM_ISSET( knownFiles_[index]->bitmask, i ) )
+    long offset  = -1;
+    int  numPackets = 0;
+    int  datagramsSent = 0;
+
+    struct RequestPacket *rp = (struct RequestPacket*) new char[sizeof(struct RequestPacket)];
+    memset( rp, 0, sizeof(struct RequestPacket) );
+    rp->fileid = id;
+    int requestNum = 0;
+
+    for( pkt_count window = 0; window < totalNum; window += FBP_BITMAP_PACKETS )
     {
-      // if we already set the first packet, this marks the end of the first
-      // range we don't have, so send the request here
-      if( offset != -1 )
+      pkt_count end = qMin( totalNum, window + FBP_BITMAP_PACKETS );
+
+      // We want whatever we don't have and nobody else requested already
+      int runs = 0;
+      for( pkt_count i = window; i < end; ++i )
+        if( isWanted( k, i, server )
+         && ( i == window || !isWanted( k, i - 1, server ) ) )
+          runs++;
+
+      if( runs * sizeof(struct _requestData) > sizeof(struct BitmapRequestPacket) )
       {
-        rp->requests[requestNum].offset = offset;
-        rp->requests[requestNum].num    = numPackets;
-        qDebug() << "Requesting" << numPackets << "packets starting with" << offset;
-        requestNum++;
-        offset = -1;
-        numPackets = 0;
-
-        // send no more than 30 requests in one packet
-        if( requestNum >= FBP_REQUESTS_PER_PACKET )
+        // Lots of small gaps, a bitmap of this window is cheaper
+        struct BitmapRequestPacket *bp = (struct BitmapRequestPacket*) new char[sizeof(struct BitmapRequestPacket)];
+        memset( bp, 0, sizeof(struct BitmapRequestPacket) );
+        bp->fileid = id;
+        bp->marker = FBP_REQUEST_BITMAP;
+        bp->offset = window;
+        for( pkt_count i = window; i < end; ++i )
+          if( isWanted( k, i, server ) )
+            BM_SET( bp->bits, i - window );
+        qDebug() << "Requesting" << runs << "ranges starting with" << window
+                 << "as a bitmap from server" << server;
+        datagramsSent++;
+        sendRequestDatagram( index, server, (const char*)bp, sizeof(struct BitmapRequestPacket) );
+        continue;
+      }
+
+      for( pkt_count i = window; i <= end; ++i )
+      {
+        if( i == end || !isWanted( k, i, server ) )
         {
-          datagramsSent++;
-          emit sendDatagram( (const char*)rp, sizeof(struct RequestPacket),
-                             knownFiles_[index]->server, knownFiles_[index]->serverPort );
-          rp = new struct RequestPacket;
-          rp->fileid = id;
-          requestNum = 0;
+          // if we already set the first packet, this marks the end of the first
+          // range we don't have, so send the request here
+          if( offset != -1 )
+          {
+            rp->requests[requestNum].offset = offset;
+            rp->requests[requestNum].num    = numPackets;
+            qDebug() << "Requesting" << numPackets << "packets starting with" << offset
+                     << "from server" << server;
+            requestNum++;
+            offset = -1;
+            numPackets = 0;
+
+            // send no more than 30 requests in one packet
+            if( requestNum >= FBP_REQUESTS_PER_PACKET )
+            {
+              datagramsSent++;
+              sendRequestDatagram( index, server, (const char*)rp, sizeof(struct RequestPacket) );
+              rp = (struct RequestPacket*) new char[sizeof(struct RequestPacket)];
+              memset( rp, 0, sizeof(struct RequestPacket) );
+              rp->fileid = id;
+              requestNum = 0;
+            }
+          }
+          // otherwise, go on searching, we haven't found the first range yet
+          continue;
         }
+
+        // If this is the first packet we see which we don't have, save it as such
+        if( offset == -1 )
+        {
+          offset = i;
+          numPackets = 1;
+        }
+        // otherwise, we are counting up
+        else
+          numPackets++;
       }
-      // otherwise, go on searching, we haven't found the first range yet
-      continue;
     }
 
-    // If this is the first packet we see which we don't have, save it as such
-    if( offset == -1 )
+    qDebug() << "RequestNum=" << requestNum;
+    if( requestNum == 0 )
     {
-      offset = i;
-      numPackets = 1;
+      delete [] (char*)rp;
+      continue;
     }
-    // otherwise, we are counting up
-    else
-      numPackets++;
+
+    // ReceiverThread will delete rp
+    sendRequestDatagram( index, server, (const char*)rp, sizeof(struct RequestPacket) );
+  }
+}
+
+/**
+ * A file that's still open grew to numPackets packets; make room for them.
+ */
+void FbpClient::growFile( struct KnownFile *f, pkt_count numPackets )
+{
+  qDebug() << "File with ID" << (int)f->id << "grew from" << f->numPackets
+           << "to" << numPackets << "packets";
+  if( f->bitmask != 0 )
+  {
+    BM_GROW( f->bitmask, f->numPackets, numPackets );
+    BM_GROW( f->heard, f->numPackets, numPackets );
+    BM_GROW( f->repair, f->numPackets, numPackets );
   }
+  f->numPackets = numPackets;
+}
+
+/**
+ * Whether we miss so few packets of the file that we're in the endgame.
+ */
+bool FbpClient::inEndgame( const struct KnownFile *f ) const
+{
+  if( !f->bitmask || f->open )
+    return false;
 
-  // If we have all packages, no request needs to be sent
-  qDebug() << "RequestNum=" << requestNum;
-  if( requestNum == 0 && datagramsSent == 0 )
+  pkt_count missing = 0;
+  for( pkt_count i = 0; i < f->numPackets; ++i )
   {
-    finishDownload( id );
-    delete rp;
-    return;
+    if( !BM_ISSET( f->bitmask, i ) && ++missing > ENDGAME_PACKETS )
+      return false;
   }
+  return true;
+}
 
-  // zero out the rest of the RequestPacket
-  for( int i = requestNum; i < FBP_REQUESTS_PER_PACKET; ++i )
+/**
+ * Decides which server we ask for the shares of each server: the server
+ * itself if we heard from it lately, otherwise the next one we did hear from.
+ * Servers that are still busy are left alone until they announce they're
+ * waiting, unless we're in the endgame.
+ */
+void FbpClient::routeShares( struct KnownFile *f ) const
+{
+  QDateTime alive = QDateTime::currentDateTime().addSecs( -SERVER_TIMEOUT_SEC );
+  bool endgame = inEndgame( f );
+  for( int i = 0; i < f->serverCount; ++i )
   {
-    rp->requests[i].offset = 0;
-    rp->requests[i].num    = 0;
+    f->route[i] = -1;
+    for( int j = 0; j < f->serverCount; ++j )
+    {
+      const struct Server *s = &f->servers[( i + j ) % f->serverCount];
+      if( !s->lastAnnouncement.isNull() && alive <= s->lastAnnouncement )
+      {
+        f->route[i] = ( s->waiting || endgame ) ? ( i + j ) % f->serverCount : -1;
+        break;
+      }
+    }
   }
+}
+
+/**
+ * Whether we should ask the given server (or the peers) for packet i: we
+ * don't have it, nobody else asked for it this round, and its share is
+ * routed there.
+ */
+bool FbpClient::isWanted( const struct KnownFile *f, pkt_count i, int server ) const
+{
+  return !BM_ISSET( f->bitmask, i ) && !BM_ISSET( f->heard, i )
+      && ( server == PEERS || f->route[( i / FBP_SHARE_PACKETS ) % f->serverCount] == server );
+}
+
+/**
+ * Sends a request to the server, and a copy of it to the group so other
+ * receivers that are still backing off can leave these packets out.
+ * Requests for the peers only go to the group.
+ */
+void FbpClient::sendRequestDatagram( int index, int server, const char *request, qint64 size )
+{
+  struct NackNotice *n = (struct NackNotice*) new char[sizeof(struct NackNotice)];
+  qint64 noticeSize = sizeof(struct NackNotice) - sizeof(n->request) + size;
+  n->zero = 0;
+  n->announceVer = ( server == PEERS ) ? FBP_PEER_REQUEST : FBP_NACK_NOTICE;
+  memcpy( &n->request, request, size );
+
+  if( server == PEERS )
+    delete [] request;
+  else
+    emit sendDatagram( request, size,
+                       knownFiles_[index]->servers[server].host,
+                       knownFiles_[index]->servers[server].port );
 
-  // ReceiverThread will delete rp
-  emit sendDatagram( (const char*)rp, sizeof(struct RequestPacket),
-                     knownFiles_[index]->server, knownFiles_[index]->serverPort );
+  emit sendDatagram( (const char*)n, noticeSize,
+                     QHostAddress( QHostAddress::Broadcast ).toString(), FBP_DEFAULT_PORT );
+}
+
+/**
+ * Asks the server for the hash pages we still need to copy from the older
+ * version of a file.
+ */
+void FbpClient::sendHashRequest( int index, int server )
+{
+  struct KnownFile *k = knownFiles_[index];
+  for( pkt_count p = 0; p < k->seedPages; ++p )
+  {
+    if( BM_ISSET( k->hashed, p ) )
+      continue;
+
+    // ReceiverThread will delete hr
+    struct HashRequest *hr = (struct HashRequest*) new char[sizeof(struct HashRequest)];
+    hr->zero        = 0;
+    hr->announceVer = FBP_HASH_REQUEST;
+    hr->fileid      = k->id;
+    hr->first       = p;
+    for( hr->num = 0; p < k->seedPages && !BM_ISSET( k->hashed, p ); ++p )
+      hr->num++;
+    emit sendDatagram( (const char*)hr, sizeof(struct HashRequest),
+                       k->servers[server].host, k->servers[server].port );
+  }
 }
 
 void FbpClient::startDownload( int id, const QDir &downloadDir )
@@ -462,9 +1042,12 @@ void FbpClient::startDownload( int id, const QDir &downloadDir )
   }
 
   // If the bitmask file is incomplete, we will assume both the data and
-  // bitmask files are incorrect and truncate them
+  // bitmask files are incorrect and truncate them. A file that's still open
+  // may have grown since we stopped, though.
   pkt_count numPackets = knownFiles_[index]->numPackets;
   int bitmaskSize = BM_SIZE(numPackets);
+  if( knownFiles_[index]->open && bitmaskFile->size() < bitmaskSize )
+    bitmaskSize = bitmaskFile->size();
   if( bitmaskFile->size() != bitmaskSize
    && bitmaskFile->size() != 0 )
   {
@@ -480,6 +1063,8 @@ void FbpClient::startDownload( int id, const QDir &downloadDir )
 
   // Allocate bitmask
   BM_INIT( knownFiles_[index]->bitmask, numPackets );
+  BM_INIT( knownFiles_[index]->heard, numPackets );
+  BM_INIT( knownFiles_[index]->repair, numPackets );
 
   // Read the bitmask from the file if it's not empty (size should be correct)
   Q_ASSERT( bitmaskFile->size() == 0 || bitmaskFile->size() == bitmaskSize );
@@ -495,6 +1080,58 @@ void FbpClient::startDownload( int id, const QDir &downloadDir )
     }
   }
 
+  // Without a bitmask, whatever is in the data file isn't ours. Packets that
+  // are all zero are never written, so it has to start out empty.
+  if( bitmaskFile->size() == 0 && !dataFile->resize( 0 ) )
+  {
+    qWarning() << "Couldn't truncate data file: " << dataFile->errorString();
+    delete bitmaskFile;
+    delete dataFile;
+    return;
+  }
+
+  // Reserve the file up to the last packet in one go, so the filesystem
+  // can lay it out in one piece however the packets come in. Writing the
+  // last packet sets the exact length.
+  struct KnownFile *k = knownFiles_[index];
+  qint64 reserve = (qint64)( numPackets - 1 ) * FBP_PACKET_DATASIZE;
+  if( !k->open && numPackets > 1 && dataFile->size() < reserve )
+  {
+    bool reserved = false;
+#ifdef Q_OS_LINUX
+    // Not posix_fallocate(), that writes zeros where this isn't supported
+    reserved = ::fallocate( dataFile->handle(), 0, 0, reserve ) == 0;
+#endif
+    if( !reserved && !dataFile->resize( reserve ) )
+    {
+      qWarning() << "Couldn't extend data file: " << dataFile->errorString();
+      delete bitmaskFile;
+      delete dataFile;
+      return;
+    }
+  }
+
+  // If we have an older version of this file, we copy what didn't change
+  // from it, going by the hashes the server publishes
+  if( bitmaskFile->size() == 0 && k->hashes && !k->open && numPackets > 0
+   && QFile::exists( k->fileName ) )
+  {
+    k->seed = new QFile( k->fileName );
+    if( k->seed->open( QIODevice::ReadOnly ) )
+    {
+      qDebug() << "Copying what didn't change from" << k->fileName;
+      k->seedPages = ( ( numPackets + FBP_HASH_BLOCK - 1 ) / FBP_HASH_BLOCK
+                     + FBP_HASHES_PER_PAGE - 1 ) / FBP_HASHES_PER_PAGE;
+      k->seedLeft  = k->seedPages;
+      BM_INIT( k->hashed, k->seedPages );
+    }
+    else
+    {
+      delete k->seed;
+      k->seed = 0;
+    }
+  }
+
   // Bitmap is now correct, we can start the download
   // (after the next line, any packets not in bitmask that come in with given
   // id will be writen to the data file, their bitmask updated, and written
@@ -1,6 +1,7 @@
 #ifndef FBPCLIENT_H
 #define FBPCLIENT_H
 
+#include <QDateTime>
 #include <QDir>
 #include <QMap>
 #include <QMutex>
@@ -33,7 +34,8 @@ signals:
   void       fileProgressChanged( int id, int progress );
   void       fileOverwriteWarning( int id, const QString &fn );
 
-  // For internal use only
+  // For internal use only; the datagram must be new[]'d, ReceiverThread
+  // deletes it once it's sent
   void sendDatagram( const char*, qint64, QString, quint16 );
 
 public slots:
@@ -41,31 +43,74 @@ public slots:
 
 private slots:
    void      clearKnownFiles();
-   void      sendRequest( int id );
+   void      sendRequest( int id, bool peers = false );
    void      flushBitmask( int id );
    void      finishDownload( int id );
+   void      sendPendingRequests();
+   void      sendRepairs();
    void      announcementReceived( struct Announcement *a, QString sender, quint16 port );
+   void      nackNoticeReceived( struct NackNotice *n, qint64 size );
+   void      zeroMapReceived( struct ZeroMap *z, qint64 size );
+   void      hashPageReceived( struct HashPage *h, qint64 size );
    void      readDataPacket( struct DataPacket *d );
    void      updateInterface();
 
 private:
+   // One of the servers announcing a file
+   struct Server {
+     QString   host;
+     quint16   port;
+     QDateTime lastAnnouncement; // null if we never heard from it
+     bool      waiting;          // its queue was empty then
+   };
+
    struct KnownFile {
      char    id;
      QString fileName;
      pkt_count numPackets;
+     char    checksum[40];
      time_t  lastAnnouncement;
-     QString server;
-     quint16 serverPort;
+     Server  servers[FBP_MAX_SERVERS];
+     int     serverCount;
+     int     route[FBP_MAX_SERVERS]; // server we ask for the shares of each, -1 for none
+     bool    unicast; // server repairs each receiver on its own
+     bool    open; // file is still growing, we don't know its checksum yet
+     bool    hashes; // server publishes block hashes
+     QFile  *seed; // older version we copy unchanged blocks from, 0 if none
+     pkt_count seedPages; // hash pages of the file
+     pkt_count seedLeft; // ... that we still need
+     BM_DEFINE(hashed); // hash pages we compared against the seed
      BM_DEFINE(bitmask);
+     BM_DEFINE(heard); // packets other receivers requested this round
+     BM_DEFINE(repair); // packets peers asked for, that we have and nobody sent yet
+     pkt_count repairNext;
    };
 
    int       progressFromBitmask( const struct KnownFile *f ) const;
+   bool      inEndgame( const struct KnownFile *f ) const;
+   void      routeShares( struct KnownFile *f ) const;
+   void      growFile( struct KnownFile *f, pkt_count numPackets );
+   bool      isWanted( const struct KnownFile *f, pkt_count i, int server ) const;
+   bool      markRequested( const struct KnownFile *f, bm_datatype *mask,
+                            struct NackNotice *n, qint64 size ) const;
+   void      sendRequestDatagram( int index, int server, const char *request, qint64 size );
+   void      sendHashRequest( int index, int server );
    QMap<int,QPair<QFile*,QFile*> > downloadingFiles_;
    QMutex downloadingFilesMutex_;
    ReceiverThread *thread_;
    QList<KnownFile*> knownFiles_;
    QTimer   *knownFileClearTimer_;
    QTimer   *updateInterfaceTimer_;
+
+   // Requests are held back for a random time, so we can leave out what
+   // other receivers request in the meantime. Maps file ID to deadline.
+   QMap<int,QDateTime> pendingRequests_;
+   QTimer   *requestTimer_;
+
+   // While we ask the peers for what we miss, maps file ID to the time we
+   // give up on them and ask the servers
+   QMap<int,QDateTime> askingPeers_;
+   QTimer   *repairTimer_;
 };
 
 #endif // FBPCLIENT_H
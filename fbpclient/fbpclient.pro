@@ -15,3 +15,7 @@ HEADERS += mainwindow.h \
     receiverthread.h \
     branding.h
 FORMS += mainwindow.ui
+
+# To receive compressed data packets (fbpd -Z), build with libzstd:
+# DEFINES += COMPRESSION
+# LIBS += -lzstd
@@ -1,5 +1,9 @@
 #include "receiverthread.h"
+#include <QTimer>
 #include <QUdpSocket>
+#ifdef COMPRESSION
+#include <zstd.h>
+#endif
 #include "../common/fbp.h"
 
 ReceiverThread::ReceiverThread(quint64 port, FbpClient *parent)
@@ -7,7 +11,14 @@ ReceiverThread::ReceiverThread(quint64 port, FbpClient *parent)
 , parent_(parent)
 , port_(port)
 , sock_(0)
+, numLayers_(1)
+, subscribed_(1)
+, joinMsec_(LAYER_JOIN_MSEC)
+, layerTimer_(0)
+, wireBytes_(0)
+, dataBytes_(0)
 {
+  memset( layers_, 0, sizeof(layers_) );
   // TODO this is very hacky. we should make ReceiverThread a simple QObject
   // and run it from elsewhere, so it has thread() != mainThread.
   // For now, hack hack hack:
@@ -16,7 +27,10 @@ ReceiverThread::ReceiverThread(quint64 port, FbpClient *parent)
 
 ReceiverThread::~ReceiverThread()
 {
+  for( int i = 1; i < subscribed_; ++i )
+    delete layers_[i].sock;
   delete sock_;
+  delete layerTimer_;
 }
 
 void ReceiverThread::run()
@@ -29,6 +43,12 @@ void ReceiverThread::run()
 
   connect( sock_, SIGNAL(readyRead()),
            this,  SLOT(onReadyRead()));
+  layers_[0].sock = sock_;
+
+  layerTimer_ = new QTimer();
+  connect( layerTimer_, SIGNAL(timeout()),
+           this,        SLOT(checkLayers()));
+  layerTimer_->start( LAYER_CHECK_MSEC );
 
   qDebug() << "ReceiverThread running!";
   exec();
@@ -39,9 +59,19 @@ void ReceiverThread::sendDatagram( const char *pkt, qint64 size,
                                    QString host, quint16 port )
 {
   sock_->writeDatagram(pkt, size, QHostAddress(host), port);
+  delete [] pkt;
 }
 
 
+/**
+ * One of our sockets can be read; see readSocket().
+ */
+void ReceiverThread::onReadyRead()
+{
+  for( int i = 0; i < subscribed_; ++i )
+    readSocket( i );
+}
+
 /**
  * A datagram can be read. If it's a data packet we are interested in, put it
  * into the inter-thread queue and register the data packet in the queue
@@ -49,18 +79,22 @@ void ReceiverThread::sendDatagram( const char *pkt, qint64 size,
  * bit set and the inter-thread queue does not contain data packets for that
  * file ID, fire an inter-thread signal for the FbpClient to make a request.
  */
-void ReceiverThread::onReadyRead()
+void ReceiverThread::readSocket( int layer )
 {
-  while( sock_->hasPendingDatagrams() )
+  BoundSocket *sock = layers_[layer].sock;
+  while( sock->hasPendingDatagrams() )
   {
     QHostAddress sender;
     quint16 port;
 
-    qint64 pendingSize = sock_->pendingDatagramSize();
-    // will be freed in the FbpClient
-    char *data = new char[pendingSize];
+    qint64 pendingSize = sock->pendingDatagramSize();
+    // will be freed in the FbpClient; announcements from older servers are
+    // shorter, their missing fields read as zero
+    qint64 allocSize = qMax( pendingSize, (qint64)sizeof(struct Announcement) );
+    char *data = new char[allocSize];
+    memset( data, 0, allocSize );
 
-    qint64 readSize = sock_->readDatagram( data, pendingSize, &sender, &port );
+    qint64 readSize = sock->readDatagram( data, pendingSize, &sender, &port );
     Q_ASSERT( readSize == pendingSize );
     Q_ASSERT( pendingSize >= 2 );
 
@@ -69,6 +103,11 @@ void ReceiverThread::onReadyRead()
 
     if( fileId )
     {
+      // Repairs from other receivers come from our own port, and aren't
+      // part of any layer
+      if( port != port_ )
+        countLayer( layer, ((struct DataPacket*) data)->seq );
+
       // is it a file we're interested in?
       if( !parent_->isDownloadingFile( fileId ) )
       {
@@ -78,6 +117,19 @@ void ReceiverThread::onReadyRead()
 
       struct DataPacket *dp = (struct DataPacket*) data;
 
+      if( dp->size & FBP_SIZE_COMPRESSED )
+      {
+#ifdef COMPRESSION
+        // Decompress here, so the FbpClient only has to write the packets
+        readCompressed( dp, readSize );
+#else
+        qWarning() << "Dropping compressed data packet for" << dp->offset
+                   << ", build with COMPRESSION to receive it";
+#endif
+        delete [] data;
+        continue;
+      }
+
       if( 0 // readSize > sizeof(struct DataPacket*)
        || dp->size > FBP_PACKET_DATASIZE
        || dp->size == 0 )
@@ -89,14 +141,30 @@ void ReceiverThread::onReadyRead()
         return;
       }
 
+      wireBytes_ += dp->size;
+      dataBytes_ += dp->size;
       emit gotDataPacket( dp );
     }
     else
     {
       // it's an announcement package, read it as such
-      if( FBP_ANNOUNCE_VERSION == data[1] )
+      if( FBP_NACK_NOTICE == data[1] || FBP_PEER_REQUEST == data[1] )
         // data will be automatically free'd by FbpClient
-        emit gotAnnouncement((struct Announcement*) data, sender.toString(), port);
+        emit gotNackNotice((struct NackNotice*) data, readSize);
+      else if( FBP_ZERO_MAP == data[1] )
+        // data will be automatically free'd by FbpClient
+        emit gotZeroMap((struct ZeroMap*) data, readSize);
+      else if( FBP_HASH_PAGE == data[1] )
+        // data will be automatically free'd by FbpClient
+        emit gotHashPage((struct HashPage*) data, readSize);
+      else if( FBP_ANNOUNCE_VERSION == data[1] )
+      {
+        struct Announcement *a = (struct Announcement*) data;
+        if( a->numLayers > numLayers_ )
+          numLayers_ = qMin( (int)a->numLayers, FBP_MAX_LAYERS );
+        // data will be automatically free'd by FbpClient
+        emit gotAnnouncement(a, sender.toString(), port);
+      }
       else
       {
         fprintf(stderr,"Announcement has version %d, cannot read.\n",data[1]);
@@ -105,3 +173,118 @@ void ReceiverThread::onReadyRead()
     }
   }
 }
+
+#ifdef COMPRESSION
+/**
+ * A compressed data packet holds several packets from its offset on. We hand
+ * each of them to the FbpClient as if it came on its own.
+ */
+void ReceiverThread::readCompressed( const struct DataPacket *dp, qint64 size )
+{
+  char raw[FBP_COMPRESS_GROUP * FBP_PACKET_DATASIZE];
+  qint64 headerSize = sizeof(struct DataPacket) - FBP_PACKET_DATASIZE;
+  size_t len = ZSTD_decompress( raw, sizeof(raw), dp->data,
+                 qMin( (qint64)( dp->size & ~FBP_SIZE_COMPRESSED ), size - headerSize ) );
+  if( ZSTD_isError( len ) )
+  {
+    qWarning() << "Couldn't decompress data packet" << dp->offset << ":"
+               << ZSTD_getErrorName( len );
+    return;
+  }
+
+  wireBytes_ += size - headerSize;
+  dataBytes_ += len;
+  for( size_t i = 0; i * FBP_PACKET_DATASIZE < len; ++i )
+  {
+    // will be freed in the FbpClient
+    struct DataPacket *part = (struct DataPacket*) new char[sizeof(struct DataPacket)];
+    part->fileid = dp->fileid;
+    part->seq    = dp->seq;
+    part->size   = qMin( (size_t)FBP_PACKET_DATASIZE, len - i * FBP_PACKET_DATASIZE );
+    part->offset = dp->offset + i;
+    memcpy( part->data, raw + i * FBP_PACKET_DATASIZE, part->size );
+    emit gotDataPacket( part );
+  }
+}
+#endif
+
+/**
+ * Counts the packets we missed on a layer, going by its sequence numbers.
+ */
+void ReceiverThread::countLayer( int layer, unsigned char seq )
+{
+  Layer *l = &layers_[layer];
+  unsigned char gap = seq - l->next;
+
+  // duplicate or reordered, or unicast to us
+  if( l->synced && gap >= 128 )
+    return;
+
+  if( l->synced )
+    l->lost += gap;
+  l->synced = true;
+  l->next   = seq + 1;
+  l->got++;
+}
+
+/**
+ * Layered servers spread their data over several ports, each doubling the
+ * rate of the ones below it. We join the next layer as long as we lose less
+ * than LAYER_JOIN_PERMILLE of the packets, and leave the highest one if we
+ * lose more than LAYER_DROP_PERMILLE. Every time we have to leave again, we
+ * wait twice as long before the next try.
+ */
+void ReceiverThread::checkLayers()
+{
+  if( numLayers_ <= 1 )
+    return;
+
+  qint64 got = 0, lost = 0;
+  for( int i = 0; i < subscribed_; ++i )
+  {
+    got  += layers_[i].got;
+    lost += layers_[i].lost;
+  }
+  if( got + lost < LAYER_MIN_SAMPLES )
+    return;
+  for( int i = 0; i < subscribed_; ++i )
+    layers_[i].got = layers_[i].lost = 0;
+
+  qint64 permille = lost * 1000 / ( got + lost );
+  QDateTime now = QDateTime::currentDateTime();
+  if( permille > LAYER_DROP_PERMILLE && subscribed_ > 1 )
+  {
+    qDebug() << "Lost" << permille << "per mille of packets";
+    leaveLayer();
+    joinMsec_ = qMin( joinMsec_ * 2, LAYER_MAX_JOIN_MSEC );
+    nextJoin_ = now.addMSecs( joinMsec_ );
+  }
+  else if( permille < LAYER_JOIN_PERMILLE && subscribed_ < numLayers_
+        && ( nextJoin_.isNull() || nextJoin_ <= now ) )
+  {
+    joinLayer();
+    nextJoin_ = now.addMSecs( joinMsec_ );
+  }
+}
+
+void ReceiverThread::joinLayer()
+{
+  Layer *l = &layers_[subscribed_];
+  l->sock   = new ReceiverThread::BoundSocket();
+  l->sock->setLocalPort( port_ + subscribed_ );
+  l->sock->bind( port_ + subscribed_, QUdpSocket::ShareAddress );
+  l->synced = false;
+  connect( l->sock, SIGNAL(readyRead()),
+           this,    SLOT(onReadyRead()));
+
+  qDebug() << "Joining layer" << subscribed_;
+  subscribed_++;
+}
+
+void ReceiverThread::leaveLayer()
+{
+  subscribed_--;
+  qDebug() << "Leaving layer" << subscribed_;
+  delete layers_[subscribed_].sock;
+  layers_[subscribed_].sock = 0;
+}
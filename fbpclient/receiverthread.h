@@ -6,6 +6,15 @@
 #include <QUdpSocket>
 #include "fbpclient.h"
 
+// Layered servers: how often we judge our loss rate, and by which limits
+// we join the next layer or leave the highest one (see checkLayers())
+#define LAYER_CHECK_MSEC    500
+#define LAYER_MIN_SAMPLES   50
+#define LAYER_JOIN_PERMILLE 10
+#define LAYER_DROP_PERMILLE 50
+#define LAYER_JOIN_MSEC     1000
+#define LAYER_MAX_JOIN_MSEC 32000
+
 class ReceiverThread : public QThread
 {
 Q_OBJECT
@@ -14,6 +23,10 @@ public:
             ~ReceiverThread();
     void     run();
 
+    // Data packet payload as it came in, and as it was after decompression
+    qint64   wireBytes() const { return wireBytes_; }
+    qint64   dataBytes() const { return dataBytes_; }
+
 signals:
     /**
      * A data packet was received. You must delete[] the DataPacket yourself.
@@ -23,9 +36,22 @@ signals:
      * An announcement packet was received. You must delete[] the Announcement yourself.
      */
     void gotAnnouncement(struct Announcement*, QString, quint16);
+    /**
+     * Another receiver sent a request. You must delete[] the NackNotice yourself.
+     */
+    void gotNackNotice(struct NackNotice*, qint64);
+    /**
+     * A server left out packets that are all zero. You must delete[] the ZeroMap yourself.
+     */
+    void gotZeroMap(struct ZeroMap*, qint64);
+    /**
+     * A server sent block hashes. You must delete[] the HashPage yourself.
+     */
+    void gotHashPage(struct HashPage*, qint64);
 
 private slots:
     void onReadyRead();
+    void checkLayers();
     void sendDatagram( const char*, qint64, QString, quint16 );
 
 private:
@@ -38,6 +64,13 @@ private:
 
     void      readAnnouncement( struct Announcement *a );
     void      readDataPacket( struct DataPacket *d, quint32 size );
+    void      readSocket( int layer );
+#ifdef COMPRESSION
+    void      readCompressed( const struct DataPacket *dp, qint64 size );
+#endif
+    void      countLayer( int layer, unsigned char seq );
+    void      joinLayer();
+    void      leaveLayer();
 
     // Used for checking whether the fbpclient is downloading something.
     // If you use this, ***MAKE SURE THE METHOD YOU USE IS THREAD SAFE!***
@@ -45,6 +78,23 @@ private:
 
     quint64 port_;
     BoundSocket *sock_;
+
+    // Layer 0 is sock_, the others are bound to port_ + their number
+    struct Layer {
+      BoundSocket  *sock;
+      bool          synced; // next is valid
+      unsigned char next;   // sequence number we expect next
+      qint64        got;    // packets since the last check
+      qint64        lost;
+    };
+    Layer     layers_[FBP_MAX_LAYERS];
+    int       numLayers_;  // as announced
+    int       subscribed_;
+    int       joinMsec_;
+    QDateTime nextJoin_;
+    QTimer   *layerTimer_;
+    qint64    wireBytes_;
+    qint64    dataBytes_;
 };
 
 #endif // RECEIVERTHREAD_H
@@ -2,6 +2,8 @@
 #	error Can not enable prefetching without enabling caching
 #endif
 
+#define	_GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <err.h>
@@ -10,9 +12,12 @@
 #include <libgen.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <openssl/sha.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -20,6 +25,9 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef COMPRESSION
+#include <zstd.h>
+#endif
 #include "fbp.h"
 #include "bitmask.h"
 #include "tree.h"
@@ -36,6 +44,15 @@
 #define	TIMEVAL_SUBSTRACT(th, tl)	(((th).tv_sec - (tl).tv_sec) * 1000000 + (th).tv_usec - (tl).tv_usec)
 #define	TIMEVAL_SET(tv, sec, usec)	do { (tv).tv_sec = sec; (tv).tv_usec = usec; } while(0)
 #define	TIMEVAL_CLEAR(tv)	TIMEVAL_SET((tv), 0, 0)
+#define	TIMEVAL_ADD_USEC(tv, usec)	do { (tv).tv_usec += (usec); (tv).tv_sec += (tv).tv_usec / 1000000; (tv).tv_usec %= 1000000; } while(0)
+
+#define	CACHELINE_SIZE	64
+#define	HUGEPAGE_SIZE	(2 * 1024 * 1024)
+#define	ROUNDUP(x, y)	((((x) + (y) - 1) / (y)) * (y))
+
+#define	DEMAND_BLOCK	1024	// packets per popularity scheduling block
+#define	DEMAND_SEEN	256	// requester hash buckets per scheduling block
+#define	MAX_UNICAST	8	// requesters we remember per block
 
 int sfd, ffd;
 pkt_count offset;
@@ -50,12 +67,272 @@ BM_DEFINE(bitmask);
 int limit_pps = 10000;
 #endif
 
+/*
+ * Popularity scheduling: instead of sweeping the queue in offset order, we
+ * keep track of how many receivers asked for each block of DEMAND_BLOCK
+ * packets, and drain the most wanted block first. A receiver counts once per
+ * block until the block is drained, however many request packets it sends;
+ * two receivers that hash alike count once, which only ever undercounts. A
+ * block that has been passed over starve_limit times is served next
+ * regardless of its demand.
+ */
+struct demandblock {
+	int queued;  // packets of this block in bitmask
+	int demand;  // receivers that asked for this block since it was last drained
+	int waited;  // times another block was picked while this one was queued
+	int lastreq; // serial of the last request packet counted in demand
+	int lastslot; // where that request's sender is in req, -1 if it isn't
+	int nreq;    // requesters since the block was last drained, -1 if too many
+	struct sockaddr_in req[MAX_UNICAST];
+	bm_datatype seen[BM_UNITS(DEMAND_SEEN)]; // receivers counted in demand, hashed
+};
+
+// Minimum time between two announcements caused by the queue running dry
+int drain_interval = 10000;
+
+/*
+ * Repairs for a block only a few receivers asked for are unicast to them, so
+ * the rest of the segment doesn't have to receive and drop them. Blocks with
+ * more than unicast_max requesters are broadcast as usual. reqmask has a bit
+ * per slot of the block's req for each queued packet, so a packet only goes
+ * to those that asked for it since it was last sent.
+ */
+int unicast_max = 0;
+unsigned char *reqmask = NULL;
+
+/*
+ * Endgame: a round that starts with at most endgame_packets queued is likely
+ * the last one for the receivers that asked, and every packet of it they
+ * lose costs them another announcement and request. So we send such a round
+ * ENDGAME_COPIES times, ENDGAME_GAP_USEC apart so one burst of loss doesn't
+ * take all copies, and announce right after the last copy instead of waiting
+ * for drain_interval. Packets requested while we repeat only go out once.
+ * With -u, we remember whom each packet of the round was unicast to, and the
+ * copies go to them again; only what was broadcast is broadcast again. It is
+ * off unless -e sets endgame_packets, as a file that fits in one such round
+ * would go out ENDGAME_COPIES times even when nothing is lost.
+ */
+#define	ENDGAME_COPIES	3
+#define	ENDGAME_GAP_USEC	5000
+
+int endgame_packets = 0;
+int sweeping = 0;           // we sent packets since the queue was last empty
+int endgame_copy = 0;       // copy of the endgame round we're sending, 0 if it isn't one
+int endgame_over = 0;       // we sent the last copy, announce right away
+pkt_count *endgame_set;     // packets of the round
+struct endgamereq {
+	int nreq; // requesters it was unicast to, 0 if it was broadcast
+	struct sockaddr_in req[MAX_UNICAST];
+} *endgame_req;             // ... with -u, whom they went to
+int endgame_count = 0;
+struct timeval endgame_at;  // when we queue them again, zero if we don't
+long endgame_repeats = 0;
+
+/*
+ * Urgent requests: a receiver that streams the file out in order marks its
+ * request for the packets it is stuck on with FBP_REQUEST_URGENT, and we send
+ * those next, instead of when the sweep gets around to them. Older servers
+ * see the marker as an empty range.
+ */
+BM_DEFINE(urgent);
+int urgent_queued = 0;
+pkt_count urgent_first; // no urgent packets before this one
+
+/*
+ * Layered transmission: every packet goes to one of numlayers ports, so slow
+ * receivers can listen to fewer of them. Of every 2^(numlayers-1) packets,
+ * layer 0 and 1 get one each, and layer k > 1 gets 2^(k-1), so each layer
+ * doubles the rate of the ones below it. The slots rotate by one every time
+ * the queue drains, so every packet passes through layer 0 eventually.
+ */
+int numlayers = 1;
+int layerround = 0;
+unsigned char layerseq[FBP_MAX_LAYERS];
+struct sockaddr_in layeraddr[FBP_MAX_LAYERS];
+
+/*
+ * Zero elision (-z): packets that are all zero, or lie in a hole of the file,
+ * are found when we start. Instead of sending them, we send a ZeroMap listing
+ * the queued zero packets of their block. The last packet always goes out as
+ * data, so the receivers learn the length of the file.
+ */
+#define	ZERO_SCAN_PACKETS	64
+
+int elide_zeros = 0;
+BM_DEFINE(zeromask);
+
+/*
+ * Delta transfer (-H): we publish a hash of every block of FBP_HASH_BLOCK
+ * packets, in pages the receivers ask for with a HashRequest. Receivers that
+ * have an older version of the file copy the blocks that didn't change from
+ * it, and only request the rest. Pages go to the group, as every receiver
+ * that seeds needs the same ones; a page we just sent isn't sent again for
+ * HASH_RESEND_USEC.
+ */
+#define	HASH_RESEND_USEC	200000
+
+int publish_hashes = 0;
+pkt_count numpages;
+struct HashPage *hashpages;
+struct timeval *hashsent;
+
+#ifdef COMPRESSION
+/*
+ * Compression (-Z level): instead of packet n, we send the aligned group of
+ * FBP_COMPRESS_GROUP packets around it as one zstd frame, if that fits in a
+ * packet. Groups that don't fit are halved until they do; if not even two
+ * packets fit, packet n goes out as it is. Compressed groups are kept in a
+ * small direct-mapped cache, and we remember how small each group had to be
+ * so we don't try in vain next time.
+ */
+#define	ZCACHE_GROUPS	1024
+
+struct zgroup {
+	struct DataPacket pkt; // offset is the first packet it holds
+	pkt_count span;        // packets it holds, 0 if the slot is empty
+	size_t rawsize;        // bytes they decompress to
+} __attribute__((__aligned__(CACHELINE_SIZE)));
+
+int compress_level = 0;
+ZSTD_CCtx *zctx;
+struct zgroup *zcache;
+unsigned char *zspan; // per group: span that fit last time, 1 if none did, 0 if never tried
+long wire_bytes = 0, data_bytes = 0; // sent since the last announcement
+#endif
+
+/*
+ * Several servers can serve the same file. Receivers send their requests for
+ * share n (FBP_SHARE_PACKETS packets) to server n % server_count, or to one of
+ * the others if that one went quiet; we just serve whatever we're asked.
+ */
+int server_index = 0;
+int server_count = 1;
+
+/*
+ * Streaming (-L): the file may still be growing, or come from a pipe, which
+ * we spool to a temporary file. We announce it with FBP_FLAG_OPEN and count
+ * only its complete packets, hashing data as it comes in. Once the pipe is
+ * closed, or the file didn't grow for stream_idle seconds, the last packet
+ * and the checksum are published.
+ */
+#define	STREAM_POLL_USEC	100000
+#define	STREAM_CHUNK	(64 * 1024)
+
+int streaming = 0;
+int stream_idle = 10;
+int stream_pipe = -1; // fd we read a piped file from
+off_t stream_size = 0; // bytes we have and hashed
+time_t stream_grew;    // when we last saw the file grow
+SHA_CTX stream_sha;
+
+int popular = 0;
+int starve_limit = 16;
+int numblocks;
+int curblock = -1;
+pkt_count lastout = -1; // the packet that last went out
+long dequeued = 0;     // packets that went out so far
+long pickedat;         // dequeued when curblock was picked
+struct demandblock *blocks;
+
+// The DataPacket comes first, so header and payload start on a cache line
 struct cachedpacket {
+	struct DataPacket pkt;
 #ifdef CACHING
 	RB_ENTRY(cachedpacket) entry;
 #endif
-	struct DataPacket pkt;
-};
+} __attribute__((__aligned__(CACHELINE_SIZE)));
+
+/*
+ * All packet buffers are carved out of one pool. We try to back it with huge
+ * pages (hugetlbfs first, then transparent huge pages) so a large cache only
+ * needs a handful of TLB entries, and fall back to normal pages otherwise.
+ */
+struct {
+	char *base;
+	size_t size;
+	size_t used;
+	size_t pagesize;
+	const char *backing;
+} pool;
+
+void
+pool_init(size_t size) {
+	size = ROUNDUP(size, CACHELINE_SIZE);
+	pool.used = 0;
+#ifdef MAP_HUGETLB
+	pool.size = ROUNDUP(size, HUGEPAGE_SIZE);
+	pool.base = mmap(NULL, pool.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+	if(pool.base != MAP_FAILED) {
+		pool.pagesize = HUGEPAGE_SIZE;
+		pool.backing = "hugetlb pages";
+		goto mapped;
+	}
+#endif
+#ifdef MADV_HUGEPAGE
+	// Over-allocate so we can align the pool on a huge page boundary
+	pool.size = ROUNDUP(size, HUGEPAGE_SIZE);
+	pool.base = mmap(NULL, pool.size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if(pool.base != MAP_FAILED) {
+		char *aligned = (char *)ROUNDUP((uintptr_t)pool.base, HUGEPAGE_SIZE);
+		if(aligned != pool.base) {
+			munmap(pool.base, aligned - pool.base);
+		}
+		munmap(aligned + pool.size, HUGEPAGE_SIZE - (aligned - pool.base));
+		pool.base = aligned;
+		if(madvise(pool.base, pool.size, MADV_HUGEPAGE) == 0) {
+			pool.pagesize = HUGEPAGE_SIZE;
+			pool.backing = "transparent huge pages";
+			goto mapped;
+		}
+		munmap(pool.base, pool.size);
+	}
+#endif
+	pool.pagesize = getpagesize();
+	pool.size = ROUNDUP(size, pool.pagesize);
+	pool.base = mmap(NULL, pool.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if(pool.base == MAP_FAILED) {
+		err(1, "mmap() (packet pool)");
+	}
+	pool.backing = "normal pages";
+
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+mapped:
+#endif
+	// Fault everything in now instead of in the middle of a transfer
+	memset(pool.base, 0, pool.size);
+}
+
+void *
+pool_alloc(size_t size) {
+	void *p;
+	size = ROUNDUP(size, CACHELINE_SIZE);
+	if(pool.used + size > pool.size) {
+		errx(1, "pool_alloc(%lu): packet pool exhausted (%lu of %lu bytes used)", (unsigned long)size, (unsigned long)pool.used, (unsigned long)pool.size);
+	}
+	p = pool.base + pool.used;
+	pool.used += size;
+	return p;
+}
+
+void
+pool_report() {
+	size_t resident = 0, basepage = getpagesize(), i;
+	unsigned char *vec = malloc(pool.size / basepage);
+	if(vec != NULL && mincore(pool.base, pool.size, (void *)vec) == 0) {
+		for(i = 0; pool.size / basepage > i; i++) {
+			if(vec[i] & 1) {
+				resident += basepage;
+			}
+		}
+	}
+	free(vec);
+	printf("Packet pool: %lu kB in %lu kB %s (%lu pages), %lu kB resident\n",
+		(unsigned long)pool.size / 1024, (unsigned long)pool.pagesize / 1024, pool.backing,
+		(unsigned long)(pool.size / pool.pagesize), (unsigned long)resident / 1024);
+	printf("Packet pool: %lu bytes per packet (%lu cache lines), %lu packets per page\n",
+		(unsigned long)sizeof(struct cachedpacket), (unsigned long)(sizeof(struct cachedpacket) / CACHELINE_SIZE),
+		(unsigned long)(pool.pagesize / sizeof(struct cachedpacket)));
+}
 
 #ifdef CACHING
 int
@@ -100,29 +377,283 @@ free_cachedpacket(struct cachedpacket *cp) {
 	}
 	errx(1, "free_cachedpacket(%p): Packet unknown (heap: %p - %p)", cp, cacheheap, &(cacheheap[cachesize]));
 }
+
+/*
+ * Shared content cache (-C name): servers of related files, say images with
+ * the same base system, can keep their packets in one POSIX shared memory
+ * segment, keyed by the SHA1 of their contents instead of by offset. A block
+ * that is in several files, or several times in one, is then read from disk
+ * once and takes up one slot. The segment is set associative: the hash of a
+ * packet picks a set of SHCACHE_WAYS slots, and a miss replaces the least
+ * recently used one. The first fbpd creates it with -c slots, the others just
+ * attach to it. The lock is not held while we read from disk.
+ */
+#define	SHCACHE_MAGIC	0x46425043
+#define	SHCACHE_WAYS	16
+
+struct shslot {
+	unsigned char key[SHA_DIGEST_LENGTH];
+	unsigned short size;   // 0 if the slot is empty
+	unsigned char fileid;  // packet that was read from disk to fill it
+	pkt_count offset;
+	unsigned long used;    // clock at its last lookup
+	char data[FBP_PACKET_DATASIZE];
+} __attribute__((__aligned__(CACHELINE_SIZE)));
+
+struct shcache {
+	unsigned int magic;    // set once the creator initialized it
+	unsigned int numsets;
+	pthread_mutex_t lock;
+	unsigned long clock;
+	long lookups, reads;   // by all servers attached to it
+	struct shslot slots[];
+};
+
+char *shcache_name = NULL;
+struct shcache *shcache = NULL;
+unsigned char (*pkthash)[SHA_DIGEST_LENGTH]; // per packet
+long sh_lookups = 0, sh_reads = 0, sh_dedup = 0; // ours, since the last announcement
+
+void
+shcache_open(const char *name, int slots) {
+	unsigned int numsets = MAX(1, slots / SHCACHE_WAYS);
+	size_t size = sizeof(struct shcache) + (size_t)numsets * SHCACHE_WAYS * sizeof(struct shslot);
+	pthread_mutexattr_t attr;
+	struct stat st;
+	int fd, created = 1, i;
+
+	if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+		if(errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) == -1) {
+			err(1, "shm_open(%s)", name);
+		}
+		created = 0;
+	}
+	if(created) {
+		if(ftruncate(fd, size) == -1) {
+			err(1, "ftruncate(%s)", name);
+		}
+	} else {
+		// Its creator may still be sizing it
+		for(i = 0; ; i++) {
+			if(fstat(fd, &st) == -1) {
+				err(1, "fstat(%s)", name);
+			}
+			if(st.st_size >= (off_t)sizeof(struct shcache)) {
+				break;
+			}
+			if(i == 500) {
+				errx(1, "shared cache %s never got sized", name);
+			}
+			usleep(10000);
+		}
+		size = st.st_size;
+	}
+	if((shcache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		err(1, "mmap(%s)", name);
+	}
+	close(fd);
+
+	if(created) {
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+		// So a server that dies holding the lock doesn't hang the others
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
 #endif
+		if(pthread_mutex_init(&shcache->lock, &attr) != 0) {
+			errx(1, "can't set up the lock of shared cache %s", name);
+		}
+		pthread_mutexattr_destroy(&attr);
+		shcache->numsets = numsets;
+		__sync_synchronize();
+		shcache->magic = SHCACHE_MAGIC;
+	} else {
+		for(i = 0; shcache->magic != SHCACHE_MAGIC; i++) {
+			if(i == 500) {
+				errx(1, "%s is not an fbpd shared cache", name);
+			}
+			usleep(10000);
+		}
+		if(sizeof(struct shcache) + (size_t)shcache->numsets * SHCACHE_WAYS * sizeof(struct shslot) > size) {
+			errx(1, "shared cache %s is smaller than it claims", name);
+		}
+	}
+	printf("Shared cache %s: %s, %u slots in sets of %d\n", name, created ? "created" : "attached",
+		shcache->numsets * SHCACHE_WAYS, SHCACHE_WAYS);
+}
+
+static void
+shcache_lock() {
+	int res = pthread_mutex_lock(&shcache->lock);
+#ifdef __linux__
+	if(res == EOWNERDEAD) {
+		// Slots are only marked full after they were filled, so nothing is torn
+		pthread_mutex_consistent(&shcache->lock);
+		res = 0;
+	}
+#endif
+	if(res != 0) {
+		errno = res;
+		err(1, "pthread_mutex_lock()");
+	}
+}
+#endif
+
+// Returns the slot of src in the requesters of b, adding it, -1 if there are too many
+static int inline
+requester_slot(struct demandblock *b, struct sockaddr_in *src) {
+	int i;
+	if(b->nreq == -1) {
+		return -1;
+	}
+	for(i = 0; b->nreq > i; i++) {
+		if(b->req[i].sin_addr.s_addr == src->sin_addr.s_addr && b->req[i].sin_port == src->sin_port) {
+			return i;
+		}
+	}
+	if(b->nreq == unicast_max) {
+		b->nreq = -1;
+		return -1;
+	}
+	b->req[b->nreq] = *src;
+	return b->nreq++;
+}
+
+// Counts the sender of request serial in the demand for b, and returns its slot as above
+static int inline
+count_demand(struct demandblock *b, int serial, struct sockaddr_in *src) {
+	int h;
+	if(b->lastreq == serial) {
+		return b->lastslot;
+	}
+	b->lastreq = serial;
+	h = (((src->sin_addr.s_addr ^ ((uint32_t)src->sin_port << 16)) * 2654435761U) >> 16) % DEMAND_SEEN;
+	if(!BM_ISSET(b->seen, h)) {
+		BM_SET(b->seen, h);
+		b->demand++;
+	}
+	return b->lastslot = requester_slot(b, src);
+}
 
 static void inline
-request_packet(int n) {
+request_packet(int n, int serial, struct sockaddr_in *src, int urge) {
+	struct demandblock *b = &blocks[n / DEMAND_BLOCK];
+	int slot;
 	if(!BM_ISSET(bitmask, n)) {
 		packets_queued++;
+		b->queued++;
 		BM_SET(bitmask, n);
 	}
+	if(urge && !BM_ISSET(urgent, n)) {
+		BM_SET(urgent, n);
+		urgent_queued++;
+		urgent_first = MIN(urgent_first, n);
+	}
+	if((slot = count_demand(b, serial, src)) != -1 && reqmask != NULL) {
+		reqmask[n] |= 1 << slot;
+	}
+}
+
+// Merges a request bitmap into our bitmask, a word at a time
+void
+request_bitmap(struct BitmapRequestPacket *bpkt, int serial, struct sockaddr_in *src) {
+	struct demandblock *b;
+	bm_datatype want, fresh;
+	int i, u, queued, slot, k;
+
+	if(bpkt->offset < 0 || bpkt->offset >= apkt.numPackets || bpkt->offset % FBP_BITMAP_PACKETS != 0) {
+		printf("Received invalid request bitmap for fileid %d\n", bpkt->fileid);
+		return;
+	}
+	for(i = 0; FBP_BITMAP_PACKETS / BM_BITS_PER_UNIT > i; i++) {
+		u = bpkt->offset / BM_BITS_PER_UNIT + i;
+		if(u * BM_BITS_PER_UNIT >= apkt.numPackets) {
+			break;
+		}
+		want = bpkt->bits[i];
+		if((u + 1) * BM_BITS_PER_UNIT > apkt.numPackets) {
+			want &= (1U << (apkt.numPackets % BM_BITS_PER_UNIT)) - 1;
+		}
+		if(want == 0) {
+			continue;
+		}
+		fresh = want & ~bitmask[u];
+		bitmask[u] |= want;
+		queued = __builtin_popcount(fresh);
+		packets_queued += queued;
+		b = &blocks[u * BM_BITS_PER_UNIT / DEMAND_BLOCK];
+		b->queued += queued;
+		if((slot = count_demand(b, serial, src)) != -1 && reqmask != NULL) {
+			for(k = 0; BM_BITS_PER_UNIT > k; k++) {
+				if(want & (1U << k)) {
+					reqmask[u * BM_BITS_PER_UNIT + k] |= 1 << slot;
+				}
+			}
+		}
+	}
 }
 
 static void inline
-fbp_sendto(const void *buf, size_t len) {
-	size_t res = sendto(sfd, buf, len, 0, (struct sockaddr *)&addr, addrlen);
+fbp_sendto(const void *buf, size_t len, struct sockaddr_in *to) {
+	size_t res = sendto(sfd, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
 	if(res == -1) {
 		err(1, "sendto()");
 	}
 }
 
+/*
+ * Unicasts buf to the receivers that asked for the queued packets from first
+ * up to end, all in block b. Returns 0 if it has to be broadcast instead.
+ */
+static int
+unicast_repair(struct demandblock *b, pkt_count first, pkt_count end, const void *buf, size_t len) {
+	unsigned char mask = 0;
+	pkt_count n;
+	int i;
+
+	if(b->nreq <= 0 || reqmask == NULL) {
+		return 0;
+	}
+	for(n = first; end > n; n++) {
+		if(BM_ISSET(bitmask, n)) {
+			mask |= reqmask[n];
+		}
+	}
+	if(mask == 0) {
+		// a broadcast queued again by the endgame
+		return 0;
+	}
+	for(i = 0; b->nreq > i; i++) {
+		if(mask & (1 << i)) {
+			fbp_sendto(buf, len, &b->req[i]);
+		}
+	}
+	return 1;
+}
+
 void
 transmit_announce_packet() {
 	printf("Announcing file %d\n", fileid);
-	apkt.status = (packets_queued > 0) ? FBP_STATUS_TRANSFERRING : FBP_STATUS_WAITING;
-	fbp_sendto(&apkt, sizeof(apkt));
+#ifdef COMPRESSION
+	if(data_bytes > 0) {
+		printf("Sent %ld kB of data as %ld kB (%.2fx)\n", data_bytes / 1024, wire_bytes / 1024, (double)data_bytes / wire_bytes);
+		data_bytes = wire_bytes = 0;
+	}
+#endif
+#ifdef CACHING
+	if(shcache != NULL && sh_lookups > 0) {
+		printf("Shared cache: read %ld of %ld packets from disk (%.2fx), %ld had the contents of another packet; %.2fx over all servers\n",
+			sh_reads, sh_lookups, (double)sh_lookups / MAX(1, sh_reads), sh_dedup, (double)shcache->lookups / MAX(1, shcache->reads));
+		sh_lookups = sh_reads = sh_dedup = 0;
+	}
+#endif
+	if(endgame_repeats > 0) {
+		printf("Endgame: repeated %ld packets\n", endgame_repeats);
+		endgame_repeats = 0;
+	}
+	// While we wait to repeat the endgame round, we aren't done yet
+	apkt.status = (packets_queued > 0 || !TIMEVAL_IS_ZERO(endgame_at)) ? FBP_STATUS_TRANSFERRING : FBP_STATUS_WAITING;
+	fbp_sendto(&apkt, sizeof(apkt), &addr);
 }
 
 
@@ -147,12 +678,333 @@ fill_data_packet(struct cachedpacket *cp) {
 	offset = cp->pkt.offset + 1;
 }
 
+// Makes room for more packets, when a streamed file grows
+void
+grow_packets(pkt_count numPackets) {
+	int oldblocks = numblocks;
+	if(numPackets <= apkt.numPackets) {
+		return;
+	}
+	BM_GROW(bitmask, apkt.numPackets, numPackets);
+	BM_GROW(urgent, apkt.numPackets, numPackets);
+	if(reqmask != NULL) {
+		if((reqmask = realloc(reqmask, numPackets)) == NULL) {
+			err(1, "realloc() (requester masks)");
+		}
+		bzero(&reqmask[apkt.numPackets], numPackets - apkt.numPackets);
+	}
+	if(zeromask != NULL) {
+		BM_GROW(zeromask, apkt.numPackets, numPackets);
+	}
+#ifdef COMPRESSION
+	if(zspan != NULL) {
+		int oldgroups = (apkt.numPackets + FBP_COMPRESS_GROUP - 1) / FBP_COMPRESS_GROUP;
+		int newgroups = (numPackets + FBP_COMPRESS_GROUP - 1) / FBP_COMPRESS_GROUP;
+		if((zspan = realloc(zspan, newgroups)) == NULL) {
+			err(1, "realloc() (compression spans)");
+		}
+		bzero(&zspan[oldgroups], newgroups - oldgroups);
+	}
+#endif
+	numblocks = (numPackets + DEMAND_BLOCK - 1) / DEMAND_BLOCK;
+	if(numblocks > oldblocks) {
+		blocks = realloc(blocks, numblocks * sizeof(struct demandblock));
+		if(blocks == NULL) {
+			err(1, "realloc() (demand blocks)");
+		}
+		bzero(&blocks[oldblocks], (numblocks - oldblocks) * sizeof(struct demandblock));
+	}
+	apkt.numPackets = numPackets;
+}
+
+static void
+stream_hash(const void *buf, size_t len) {
+	if(SHA1_Update(&stream_sha, buf, len) == 0) {
+		errno = 0;
+		err(1, "SHA1_Update() failed; possible cause");
+	}
+	stream_size += len;
+}
+
+/*
+ * Takes in whatever was appended to the file, or whatever the pipe has for
+ * us. Returns 1 if we now have more complete packets, -1 if the file is
+ * complete.
+ */
+int
+stream_poll() {
+	char buf[STREAM_CHUNK];
+	struct stat st;
+	ssize_t len;
+	pkt_count old = apkt.numPackets;
+
+	if(stream_pipe != -1) {
+		if((len = read(stream_pipe, buf, sizeof(buf))) == -1) {
+			err(1, "read (pipe)");
+		}
+		if(len == 0) {
+			return -1;
+		}
+		if(pwrite(ffd, buf, len, stream_size) != len) {
+			err(1, "pwrite (spool file)");
+		}
+		stream_hash(buf, len);
+	} else {
+		if(fstat(ffd, &st) == -1) {
+			err(1, "fstat");
+		}
+		if(st.st_size == stream_size) {
+			return (time(NULL) - stream_grew >= stream_idle) ? -1 : 0;
+		}
+		while(st.st_size > stream_size) {
+			if((len = pread(ffd, buf, MIN(sizeof(buf), st.st_size - stream_size), stream_size)) <= 0) {
+				err(1, "pread");
+			}
+			stream_hash(buf, len);
+		}
+	}
+	stream_grew = time(NULL);
+	grow_packets(stream_size / FBP_PACKET_DATASIZE);
+	return apkt.numPackets > old;
+}
+
+// The file is complete: publish its last packet and checksum
+void
+stream_finish() {
+	unsigned char digest[20];
+	if(SHA1_Final(digest, &stream_sha) == 0) {
+		errno = 0;
+		err(1, "SHA1_Final() failed; possible cause");
+	}
+	sha1_hex(apkt.checksum, digest);
+	grow_packets(ceil(stream_size / (double)FBP_PACKET_DATASIZE));
+	apkt.flags &= ~FBP_FLAG_OPEN;
+	streaming = 0;
+	if(stream_pipe != -1) {
+		close(stream_pipe);
+		stream_pipe = -1;
+	}
+	printf("Stream complete: %ld bytes, %d packets\n", (long)stream_size, apkt.numPackets);
+}
+
+// libc's memcmp() is vectorized, comparing the buffer to itself shifted by one byte uses that
+static int inline
+is_zero(const char *buf, size_t len) {
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/*
+ * Marks the packets that are all zero in zeromask, except for the last one.
+ * Holes are skipped without reading them, where the system can tell us
+ * where they are.
+ */
+void
+scan_zeros(off_t size) {
+	char buf[ZERO_SCAN_PACKETS * FBP_PACKET_DATASIZE];
+	pkt_count n = 0, m, i, zeros = 0, last = apkt.numPackets - 1;
+	off_t data;
+
+	BM_INIT(zeromask, apkt.numPackets);
+	while(last > n) {
+		data = (off_t)n * FBP_PACKET_DATASIZE;
+#ifdef SEEK_DATA
+		if((data = lseek(ffd, data, SEEK_DATA)) == -1) {
+			// ENXIO: nothing but a hole from here on
+			data = (errno == ENXIO) ? size : (off_t)n * FBP_PACKET_DATASIZE;
+		}
+#endif
+		for(; last > n && (off_t)(n + 1) * FBP_PACKET_DATASIZE <= data; n++) {
+			BM_SET(zeromask, n);
+			zeros++;
+		}
+		m = MIN(ZERO_SCAN_PACKETS, last - n);
+		if(m == 0) {
+			break;
+		}
+		if(pread(ffd, buf, m * FBP_PACKET_DATASIZE, (off_t)n * FBP_PACKET_DATASIZE) != m * FBP_PACKET_DATASIZE) {
+			err(1, "pread");
+		}
+		for(i = 0; m > i; i++, n++) {
+			if(is_zero(&buf[i * FBP_PACKET_DATASIZE], FBP_PACKET_DATASIZE)) {
+				BM_SET(zeromask, n);
+				zeros++;
+			}
+		}
+	}
+	printf("%d of %d packets are zero and won't be sent as data\n", zeros, apkt.numPackets);
+}
+
+// Fills hashpages for the whole file
+void
+hash_blocks() {
+	char buf[FBP_HASH_BLOCK * FBP_PACKET_DATASIZE];
+	pkt_count numblocks = (apkt.numPackets + FBP_HASH_BLOCK - 1) / FBP_HASH_BLOCK, b;
+	ssize_t len;
+
+	numpages = (numblocks + FBP_HASHES_PER_PAGE - 1) / FBP_HASHES_PER_PAGE;
+	hashpages = calloc(MAX(1, numpages), sizeof(struct HashPage));
+	hashsent = calloc(MAX(1, numpages), sizeof(struct timeval));
+	if(hashpages == NULL || hashsent == NULL) {
+		err(1, "calloc() (block hashes)");
+	}
+	for(b = 0; numblocks > b; b++) {
+		struct HashPage *page = &hashpages[b / FBP_HASHES_PER_PAGE];
+		if((len = pread(ffd, buf, sizeof(buf), (off_t)b * sizeof(buf))) <= 0) {
+			err(1, "pread");
+		}
+		sha1_block(page->hashes[b % FBP_HASHES_PER_PAGE], buf, len);
+		page->announceVer = FBP_HASH_PAGE;
+		page->fileid = fileid;
+		page->page = b / FBP_HASHES_PER_PAGE;
+	}
+	printf("Publishing hashes of %d blocks in %d pages\n", numblocks, numpages);
+}
+
+// Sends the hash pages a receiver asked for, unless we just did
+void
+request_hashes(struct HashRequest *hreq) {
+	pkt_count numblocks = (apkt.numPackets + FBP_HASH_BLOCK - 1) / FBP_HASH_BLOCK, p;
+	struct timeval now;
+	size_t len;
+
+	if(hashpages == NULL || hreq->first < 0 || hreq->num < 0 || hreq->first > numpages || hreq->num > numpages - hreq->first) {
+		printf("Received invalid hash request for fileid %d\n", hreq->fileid);
+		return;
+	}
+	gettimeofday(&now, NULL);
+	for(p = hreq->first; hreq->first + hreq->num > p; p++) {
+		if(!TIMEVAL_IS_ZERO(hashsent[p]) && TIMEVAL_SUBSTRACT(now, hashsent[p]) < HASH_RESEND_USEC) {
+			continue;
+		}
+		hashsent[p] = now;
+		len = sizeof(struct HashPage) - FBP_HASH_SIZE * (FBP_HASHES_PER_PAGE - MIN(FBP_HASHES_PER_PAGE, numblocks - p * FBP_HASHES_PER_PAGE));
+		fbp_sendto(&hashpages[p], len, &addr);
+	}
+}
+
+#ifdef CACHING
+static int
+cmpdigest(const void *a, const void *b) {
+	return memcmp(a, b, SHA_DIGEST_LENGTH);
+}
+
+/*
+ * Hashes every packet of the file, and tells how many of them have the same
+ * contents as another one.
+ */
+void
+hash_packets() {
+	char buf[FBP_HASH_BLOCK * FBP_PACKET_DATASIZE];
+	unsigned char (*sorted)[SHA_DIGEST_LENGTH];
+	pkt_count n, m, distinct = 0;
+	SHA_CTX ctx;
+	ssize_t len;
+
+	pkthash = malloc(MAX(1, apkt.numPackets) * SHA_DIGEST_LENGTH);
+	sorted = malloc(MAX(1, apkt.numPackets) * SHA_DIGEST_LENGTH);
+	if(pkthash == NULL || sorted == NULL) {
+		err(1, "malloc() (packet hashes)");
+	}
+	for(n = 0; apkt.numPackets > n; n += FBP_HASH_BLOCK) {
+		if((len = pread(ffd, buf, sizeof(buf), (off_t)n * FBP_PACKET_DATASIZE)) <= 0) {
+			err(1, "pread");
+		}
+		for(m = 0; len > m * FBP_PACKET_DATASIZE; m++) {
+			if(SHA1_Init(&ctx) == 0
+			 || SHA1_Update(&ctx, &buf[m * FBP_PACKET_DATASIZE], MIN(FBP_PACKET_DATASIZE, len - m * FBP_PACKET_DATASIZE)) == 0
+			 || SHA1_Final(pkthash[n + m], &ctx) == 0) {
+				errno = 0;
+				err(1, "SHA1 failed; possible cause");
+			}
+		}
+	}
+	memcpy(sorted, pkthash, apkt.numPackets * SHA_DIGEST_LENGTH);
+	qsort(sorted, apkt.numPackets, SHA_DIGEST_LENGTH, cmpdigest);
+	for(n = 0; apkt.numPackets > n; n++) {
+		if(n == 0 || memcmp(sorted[n], sorted[n - 1], SHA_DIGEST_LENGTH) != 0) {
+			distinct++;
+		}
+	}
+	free(sorted);
+	printf("%d packets, %d different contents (%.2fx)\n", apkt.numPackets, distinct, (double)apkt.numPackets / MAX(1, distinct));
+}
+
+// Packet n from the shared cache, or from disk into it
+struct cachedpacket *
+shcache_get(pkt_count n) {
+	static struct cachedpacket *cp = NULL;
+	struct shslot *set, *s = NULL;
+	unsigned int h;
+	int i;
+
+	if(cp == NULL) {
+		cp = pool_alloc(sizeof(struct cachedpacket));
+	}
+	cp->pkt.fileid = fileid;
+	cp->pkt.offset = n;
+	memcpy(&h, pkthash[n], sizeof(h));
+	set = &shcache->slots[(h % shcache->numsets) * SHCACHE_WAYS];
+
+	shcache_lock();
+	shcache->lookups++;
+	shcache->clock++;
+	sh_lookups++;
+	for(i = 0; SHCACHE_WAYS > i; i++) {
+		if(set[i].size != 0 && memcmp(set[i].key, pkthash[n], SHA_DIGEST_LENGTH) == 0) {
+			s = &set[i];
+			break;
+		}
+	}
+	if(s != NULL) {
+		s->used = shcache->clock;
+		memcpy(cp->pkt.data, s->data, s->size);
+		cp->pkt.size = s->size;
+		if(s->fileid != fileid || s->offset != n) {
+			sh_dedup++;
+		}
+		pthread_mutex_unlock(&shcache->lock);
+		return cp;
+	}
+	pthread_mutex_unlock(&shcache->lock);
+
+	fill_data_packet(cp);
+	sh_reads++;
+
+	shcache_lock();
+	shcache->reads++;
+	for(i = 0; SHCACHE_WAYS > i; i++) {
+		if(set[i].size != 0 && memcmp(set[i].key, pkthash[n], SHA_DIGEST_LENGTH) == 0) {
+			// Someone else read it meanwhile
+			pthread_mutex_unlock(&shcache->lock);
+			return cp;
+		}
+		if(s == NULL || set[i].size == 0 || (s->size != 0 && s->used > set[i].used)) {
+			s = &set[i];
+		}
+	}
+	s->size = 0;
+	__sync_synchronize();
+	memcpy(s->key, pkthash[n], SHA_DIGEST_LENGTH);
+	memcpy(s->data, cp->pkt.data, cp->pkt.size);
+	s->fileid = fileid;
+	s->offset = n;
+	s->used = shcache->clock;
+	__sync_synchronize();
+	s->size = cp->pkt.size;
+	pthread_mutex_unlock(&shcache->lock);
+	return cp;
+}
+#endif
+
 struct cachedpacket *
 get_data_packet(int n) {
 	struct cachedpacket *cp;
 #ifdef CACHING
 	struct cachedpacket find, *fcp;
 
+	if(shcache != NULL) {
+		return shcache_get(n);
+	}
 	find.pkt.offset = n;
 	// We zoeken naar offset n, en als die niet bestaat degene met hoogste offset daaronder
 	fcp = RB_PFIND(pktcache, &cachetree, &find);
@@ -176,7 +1028,11 @@ get_data_packet(int n) {
 #endif
 	}
 #else
-	cp = malloc(sizeof(struct cachedpacket));
+	static struct cachedpacket *sendbuf = NULL;
+	if(sendbuf == NULL) {
+		sendbuf = pool_alloc(sizeof(struct cachedpacket));
+	}
+	cp = sendbuf;
 #endif
 	assert(cp != NULL);
 	cp->pkt.offset = n;
@@ -187,10 +1043,68 @@ get_data_packet(int n) {
 	return cp;
 }
 
+int
+pick_block() {
+	int i, b, best = -1;
+	for(i = 0; numblocks > i; i++) {
+		b = ((offset / DEMAND_BLOCK) + i) % numblocks;
+		if(blocks[b].queued == 0) {
+			continue;
+		}
+		if(best == -1) {
+			best = b;
+		} else if(blocks[best].waited >= starve_limit || blocks[b].waited >= starve_limit) {
+			if(blocks[b].waited > blocks[best].waited) {
+				best = b;
+			}
+		} else if(blocks[b].demand > blocks[best].demand) {
+			best = b;
+		}
+	}
+	assert(best != -1);
+	for(b = 0; numblocks > b; b++) {
+		if(blocks[b].queued > 0) {
+			blocks[b].waited++;
+		}
+	}
+	blocks[best].waited = 0;
+	return best;
+}
+
 pkt_count
 get_next_packet() {
 	assert(packets_queued > 0);
 	pkt_count n = offset % apkt.numPackets;
+	if(urgent_queued > 0) {
+		for(n = urgent_first; !BM_ISSET(urgent, n); n++);
+		urgent_first = n;
+		return n;
+	}
+	if(popular) {
+		// A block is picked for one pass, so one that keeps being asked for
+		// again can't hold back the others until it drains. The pass goes on
+		// after the packet that last went out, as offset only moves when a
+		// packet is read from the file.
+		n = (lastout + 1) % apkt.numPackets;
+		if(curblock == -1 || blocks[curblock].queued == 0 || (n / DEMAND_BLOCK != curblock && dequeued != pickedat)) {
+			curblock = pick_block();
+			pickedat = dequeued;
+		}
+		if(n / DEMAND_BLOCK != curblock) {
+			n = curblock * DEMAND_BLOCK;
+		}
+		while(!BM_ISSET(bitmask, n)) {
+			n++;
+			if(n == apkt.numPackets || n % DEMAND_BLOCK == 0) {
+				if(dequeued != pickedat) {
+					curblock = pick_block();
+					pickedat = dequeued;
+				}
+				n = curblock * DEMAND_BLOCK;
+			}
+		}
+		return n;
+	}
 	while(!BM_ISSET(bitmask, n)) {
 		n = (n+1) % apkt.numPackets;
 	}
@@ -201,36 +1115,280 @@ get_next_packet() {
 void
 prefetch_packet() {
 	pkt_count n = get_next_packet();
-	get_data_packet(n);
+	if(zeromask == NULL || !BM_ISSET(zeromask, n)) {
+		get_data_packet(n);
+	}
 }
 #endif
 
-void
-transmit_data_packet() {
-	pkt_count n = get_next_packet();
-	struct cachedpacket *cp = get_data_packet(n);
+static int inline
+layer_of(pkt_count n) {
+	int slot = (n + layerround) % (1 << (numlayers - 1));
+	return (slot == 0) ? 0 : 32 - __builtin_clz(slot);
+}
+
+#ifdef COMPRESSION
+// Returns the compressed group holding packet n, or NULL if n has to go out as it is
+struct zgroup *
+compress_group(pkt_count n) {
+	char raw[FBP_COMPRESS_GROUP * FBP_PACKET_DATASIZE];
+	pkt_count g = n / FBP_COMPRESS_GROUP, first, count;
+	struct zgroup *z = &zcache[g % ZCACHE_GROUPS];
+	int span, tried = 0;
+	ssize_t len;
+	size_t res;
+
+	if(z->span > 0 && z->pkt.offset <= n && z->pkt.offset + z->span > n) {
+		return z;
+	}
+	for(span = zspan[g] ? zspan[g] : FBP_COMPRESS_GROUP; span > 1; span /= 2) {
+		first = n - n % span;
+		count = MIN(span, apkt.numPackets - first);
+		if(count < 2) {
+			continue;
+		}
+		if((len = pread(ffd, raw, count * FBP_PACKET_DATASIZE, (off_t)first * FBP_PACKET_DATASIZE)) == -1) {
+			err(1, "pread");
+		}
+		z->span = 0;
+		tried = 1;
+		res = ZSTD_compressCCtx(zctx, z->pkt.data, FBP_PACKET_DATASIZE, raw, len, compress_level);
+		if(ZSTD_isError(res)) {
+			// doesn't fit in a packet
+			continue;
+		}
+		z->pkt.fileid = fileid;
+		z->pkt.offset = first;
+		z->pkt.size = FBP_SIZE_COMPRESSED | res;
+		z->span = count;
+		z->rawsize = len;
+		zspan[g] = span;
+		return z;
+	}
+	if(tried) {
+		zspan[g] = 1;
+	}
+	return NULL;
+}
+#endif
 
-	fbp_sendto(&cp->pkt, sizeof(struct DataPacket) - FBP_PACKET_DATASIZE + cp->pkt.size);
+// Takes packet n off the queue, now that it went out
+static void
+dequeue_packet(pkt_count n) {
+	struct demandblock *b = &blocks[n / DEMAND_BLOCK];
 
 	packets_queued--;
 	BM_CLR(bitmask, n);
+	lastout = n;
+	dequeued++;
+	if(endgame_copy == 1 && endgame_count < endgame_packets) {
+		if(reqmask != NULL) {
+			struct endgamereq *e = &endgame_req[endgame_count];
+			int i;
+			e->nreq = 0;
+			for(i = 0; b->nreq > i; i++) {
+				if(reqmask[n] & (1 << i)) {
+					e->req[e->nreq++] = b->req[i];
+				}
+			}
+		}
+		endgame_set[endgame_count++] = n;
+	}
+	if(reqmask != NULL) {
+		reqmask[n] = 0;
+	}
+	if(urgent_queued > 0 && BM_ISSET(urgent, n)) {
+		BM_CLR(urgent, n);
+		urgent_queued--;
+	}
+	if(--b->queued == 0) {
+		b->demand = 0;
+		b->nreq = 0;
+		bzero(b->seen, sizeof(b->seen));
+	}
+	if(packets_queued == 0) {
+		layerround++;
+		sweeping = 0;
+		if(endgame_copy > 0 && ENDGAME_COPIES > endgame_copy) {
+			gettimeofday(&endgame_at, NULL);
+			TIMEVAL_ADD_USEC(endgame_at, ENDGAME_GAP_USEC);
+		} else if(endgame_copy > 0) {
+			endgame_copy = 0;
+			endgame_over = 1;
+		}
+	}
+}
+
+// Queues the packets of the endgame round again for its next copy, for whom they went to
+void
+endgame_repeat() {
+	struct demandblock *b;
+	int i, j, slot;
+
+	TIMEVAL_CLEAR(endgame_at);
+	endgame_copy++;
+	for(i = 0; endgame_count > i; i++) {
+		pkt_count n = endgame_set[i];
+		if(BM_ISSET(bitmask, n)) {
+			continue;
+		}
+		b = &blocks[n / DEMAND_BLOCK];
+		packets_queued++;
+		b->queued++;
+		BM_SET(bitmask, n);
+		endgame_repeats++;
+		for(j = 0; reqmask != NULL && endgame_req[i].nreq > j; j++) {
+			if((slot = requester_slot(b, &endgame_req[i].req[j])) != -1) {
+				reqmask[n] |= 1 << slot;
+			}
+		}
+	}
+}
+
+/*
+ * Sends a ZeroMap for zero packet n and the queued zero packets after it in
+ * its block, instead of the packets themselves. It isn't part of any layer's
+ * sequence, so it goes to the base layer.
+ */
+void
+transmit_zero_map(pkt_count n) {
+	struct ZeroMap zpkt;
+	struct demandblock *b = &blocks[n / DEMAND_BLOCK];
+	pkt_count end = MIN(apkt.numPackets - 1, (n / DEMAND_BLOCK + 1) * DEMAND_BLOCK);
+	pkt_count m;
+	size_t len;
+	int rid = -1, i;
+
+	bzero(&zpkt, sizeof(zpkt));
+	zpkt.zero = 0;
+	zpkt.announceVer = FBP_ZERO_MAP;
+	zpkt.ranges.fileid = fileid;
+	for(m = n; end > m; m++) {
+		if(!BM_ISSET(bitmask, m) || !BM_ISSET(zeromask, m)) {
+			continue;
+		}
+		if(rid == -1 || zpkt.ranges.requests[rid].offset + zpkt.ranges.requests[rid].num != m) {
+			if(rid + 1 == FBP_REQUESTS_PER_PACKET) {
+				break;
+			}
+			zpkt.ranges.requests[++rid].offset = m;
+		}
+		zpkt.ranges.requests[rid].num++;
+	}
+	len = sizeof(zpkt) - (FBP_REQUESTS_PER_PACKET - (rid + 1)) * sizeof(struct _requestData);
+
+	if(!unicast_repair(b, n, zpkt.ranges.requests[rid].offset + zpkt.ranges.requests[rid].num, &zpkt, len)) {
+		fbp_sendto(&zpkt, len, &layeraddr[0]);
+	}
+
+	for(i = 0; rid >= i; i++) {
+		for(m = zpkt.ranges.requests[i].offset; zpkt.ranges.requests[i].offset + zpkt.ranges.requests[i].num > m; m++) {
+			dequeue_packet(m);
+		}
+	}
+}
+
+void
+transmit_data_packet() {
+	pkt_count n = get_next_packet(), first = n, span = 1;
+	struct DataPacket *pkt = NULL;
+	struct demandblock *b = &blocks[n / DEMAND_BLOCK];
+	size_t len;
+	int l;
+
+	if(!sweeping) {
+		sweeping = 1;
+		if(endgame_copy == 0 && endgame_packets > 0 && endgame_packets >= packets_queued) {
+			endgame_copy = 1;
+			endgame_count = 0;
+		}
+	}
+	if(endgame_copy == 1 && packets_queued + endgame_count > endgame_packets) {
+		// more requests came in, it's a normal round after all
+		endgame_copy = 0;
+	}
+
+	if(zeromask != NULL && BM_ISSET(zeromask, n)) {
+		transmit_zero_map(n);
+		return;
+	}
+#ifdef COMPRESSION
+	struct zgroup *z;
+	if(compress_level > 0 && (z = compress_group(n)) != NULL) {
+		pkt = &z->pkt;
+		first = z->pkt.offset;
+		span = z->span;
+		data_bytes += z->rawsize;
+	}
+#endif
+	if(pkt == NULL) {
+		pkt = &get_data_packet(n)->pkt;
+#ifdef COMPRESSION
+		data_bytes += pkt->size;
+#endif
+	}
+	len = sizeof(struct DataPacket) - FBP_PACKET_DATASIZE + (pkt->size & ~FBP_SIZE_COMPRESSED);
+#ifdef COMPRESSION
+	wire_bytes += len - (sizeof(struct DataPacket) - FBP_PACKET_DATASIZE);
+#endif
+
+	// Not part of any layer's sequence if unicast; receivers see it as a duplicate
+	pkt->seq = layerseq[0] - 1;
+	if(!unicast_repair(b, first, first + span, pkt, len)) {
+		l = layer_of(n);
+		pkt->seq = layerseq[l]++;
+		fbp_sendto(pkt, len, &layeraddr[l]);
+	}
+	// A compressed group takes along whatever else of it was queued
+	for(n = first; first + span > n; n++) {
+		if(BM_ISSET(bitmask, n)) {
+			dequeue_packet(n);
+		}
+	}
 }
 
 void
 receive_packet() {
-	struct RequestPacket rpkt;
+	static int serial = 0;
+	union {
+		struct RequestPacket r;
+		struct BitmapRequestPacket b;
+		struct HashRequest h;
+	} buf;
+	struct RequestPacket *rpkt = &buf.r;
+	struct sockaddr_in src;
+	socklen_t srclen = sizeof(src);
+	ssize_t len;
 	int i;
-	if(recv(sfd, &rpkt, sizeof(rpkt), 0) == -1) {
-		err(1, "recv");
+	serial++;
+	if((len = recvfrom(sfd, &buf, sizeof(buf), 0, (struct sockaddr *)&src, &srclen)) == -1) {
+		err(1, "recvfrom");
+	}
+	if(len == sizeof(struct BitmapRequestPacket) && buf.b.marker == FBP_REQUEST_BITMAP) {
+		request_bitmap(&buf.b, serial, &src);
+		return;
 	}
+	if(len == sizeof(struct HashRequest) && buf.h.zero == 0 && buf.h.announceVer == FBP_HASH_REQUEST) {
+		request_hashes(&buf.h);
+		return;
+	}
+	if(len != sizeof(struct RequestPacket)) {
+		printf("Received request of invalid length %zd\n", len);
+		return;
+	}
+	int urge = (rpkt->requests[FBP_REQUESTS_PER_PACKET - 1].offset == FBP_REQUEST_URGENT);
 	for(i=0; 30 > i; i++) {
-		if(rpkt.requests[i].offset > apkt.numPackets || rpkt.requests[i].offset + rpkt.requests[i].num > apkt.numPackets) {
-			printf("Received invalid request range for fileid %d\n", rpkt.fileid);
+		if(urge && i == FBP_REQUESTS_PER_PACKET - 1 && rpkt->requests[i].num == 0) {
+			break;
+		}
+		if(rpkt->requests[i].offset < 0 || rpkt->requests[i].num < 0
+		 || rpkt->requests[i].offset > apkt.numPackets || rpkt->requests[i].num > apkt.numPackets - rpkt->requests[i].offset) {
+			printf("Received invalid request range for fileid %d\n", rpkt->fileid);
 			return;
 		}
 		pkt_count n;
-		for(n = rpkt.requests[i].offset; rpkt.requests[i].offset + rpkt.requests[i].num > n; n++) {
-			request_packet(n);
+		for(n = rpkt->requests[i].offset; rpkt->requests[i].offset + rpkt->requests[i].num > n; n++) {
+			request_packet(n, serial, &src, urge);
 		}
 	}
 }
@@ -241,10 +1399,14 @@ usage(char *progname) {
 #ifdef RATE_LIMIT
 	"[-p 100000] "
 #endif
+	"[-a 10] [-e 0] [-H] [-l 1] [-L [-i 10]] [-P [-w 16]] [-s 0/1] [-u 0] [-z] "
 #ifdef CACHING
-	"[-c 1] "
+	"[-c 1] [-C /fbpcache] "
 #endif
-	"<fid> <file>\n", progname);
+#ifdef COMPRESSION
+	"[-Z 3] "
+#endif
+	"<fid> <file | - with -L>\n", progname);
 	exit(1);
 }
 
@@ -253,7 +1415,13 @@ main(int argc, char **argv) {
 	struct stat st;
 	fd_set rfds, wfds;
 	int want_announce = 1;
+	int drained = 0;
+	int i;
 	struct timeval now = { 0, 0 };
+	struct timeval lastAnnounce = { 0, 0 };
+	struct timeval lastPoll = { 0, 0 };
+	int maxfd, grown;
+	size_t poolsize;
 #ifdef RATE_LIMIT
 	int patsts = limit_pps; // Packets allowed to send this second
 	struct timeval nextPacket = { 0, 0 };
@@ -262,12 +1430,27 @@ main(int argc, char **argv) {
 	char *bcast_addr = "127.0.0.1";
 
 	assert((1 >> 1) == 0 /* require little endian */);
+	assert(BM_BITS_PER_UNIT == 32 /* request bitmaps are merged a word at a time */);
 
-	while((ch = getopt(argc, argv, "b:p:c:")) != -1) {
+	while((ch = getopt(argc, argv, "a:b:e:p:c:C:Hi:l:LPs:u:w:zZ:")) != -1) {
 		switch(ch) {
+			case 'a':
+				drain_interval = strtol(optarg, (char **)NULL, 10) * 1000;
+				if(drain_interval < 0 || drain_interval >= 1000000) {
+					fprintf(stderr, "%s: drain announcement interval must be between 0 and 999 ms\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
 			case 'b':
 				bcast_addr = optarg;
 				break;
+			case 'e':
+				endgame_packets = strtol(optarg, (char **)NULL, 10);
+				if(endgame_packets < 0 || endgame_packets > 1000000) {
+					fprintf(stderr, "%s: endgame threshold must be between 0 and 1000000 packets\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
 #ifdef RATE_LIMIT
 			case 'p':
 				limit_pps = strtol(optarg, (char **)NULL, 10);
@@ -285,6 +1468,65 @@ main(int argc, char **argv) {
 					usage(argv[0]);
 				}
 				break;
+			case 'C':
+				shcache_name = optarg;
+				break;
+#endif
+			case 'H':
+				publish_hashes = 1;
+				break;
+			case 'i':
+				stream_idle = strtol(optarg, (char **)NULL, 10);
+				if(stream_idle < 1) {
+					fprintf(stderr, "%s: stream idle time must be at least 1 second\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
+			case 'L':
+				streaming = 1;
+				break;
+			case 'l':
+				numlayers = strtol(optarg, (char **)NULL, 10);
+				if(numlayers < 1 || numlayers > FBP_MAX_LAYERS) {
+					fprintf(stderr, "%s: number of layers must be between 1 and %d\n", argv[0], FBP_MAX_LAYERS);
+					usage(argv[0]);
+				}
+				break;
+			case 'P':
+				popular = 1;
+				break;
+			case 's':
+				if(sscanf(optarg, "%d/%d", &server_index, &server_count) != 2
+				 || server_count < 1 || server_count > FBP_MAX_SERVERS || server_index < 0 || server_index >= server_count) {
+					fprintf(stderr, "%s: server must be given as <index>/<count>, with count at most %d\n", argv[0], FBP_MAX_SERVERS);
+					usage(argv[0]);
+				}
+				break;
+			case 'u':
+				unicast_max = strtol(optarg, (char **)NULL, 10);
+				if(unicast_max < 0 || unicast_max > MAX_UNICAST) {
+					fprintf(stderr, "%s: unicast threshold must be between 0 and %d\n", argv[0], MAX_UNICAST);
+					usage(argv[0]);
+				}
+				break;
+			case 'w':
+				starve_limit = strtol(optarg, (char **)NULL, 10);
+				if(starve_limit < 1) {
+					fprintf(stderr, "%s: starvation limit must be at least 1\n", argv[0]);
+					usage(argv[0]);
+				}
+				break;
+			case 'z':
+				elide_zeros = 1;
+				break;
+#ifdef COMPRESSION
+			case 'Z':
+				compress_level = strtol(optarg, (char **)NULL, 10);
+				if(compress_level < 1 || compress_level > ZSTD_maxCLevel()) {
+					fprintf(stderr, "%s: compression level must be between 1 and %d\n", argv[0], ZSTD_maxCLevel());
+					usage(argv[0]);
+				}
+				break;
 #endif
 			default:
 				usage(argv[0]);
@@ -301,19 +1543,51 @@ main(int argc, char **argv) {
 		usage(argv[0]);
 	}
 
-	if((ffd = open(argv[optind + 1], O_RDONLY)) == -1) {
+	// Zero maps, hashes and the shared cache all need the whole file up front
+	if(streaming && (elide_zeros || publish_hashes)) {
+		fprintf(stderr, "%s: -z and -H don't work with -L\n", argv[0]);
+		usage(argv[0]);
+	}
+#ifdef CACHING
+	if(streaming && shcache_name != NULL) {
+		fprintf(stderr, "%s: -C doesn't work with -L\n", argv[0]);
+		usage(argv[0]);
+	}
+#endif
+
+	if(streaming && strcmp(argv[optind + 1], "-") == 0) {
+		char spool[] = "/tmp/fbpd.XXXXXX";
+		if((ffd = mkstemp(spool)) == -1) {
+			err(1, "mkstemp(%s)", spool);
+		}
+		unlink(spool);
+		stream_pipe = STDIN_FILENO;
+	} else if((ffd = open(argv[optind + 1], O_RDONLY)) == -1) {
 		err(1, "open(%s)", argv[optind + 1]);
 	}
 
 	if(fstat(ffd, &st) == -1) {
 		err(1, "fstat(%s)", argv[optind + 1]);
 	}
+	if(streaming) {
+		// Packets are added as the data comes in
+		st.st_size = 0;
+		stream_grew = time(NULL);
+		if(SHA1_Init(&stream_sha) == 0) {
+			errno = 0;
+			err(1, "SHA1_Init() failed; possible cause");
+		}
+	}
 
 	bzero(&addr, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = inet_addr(bcast_addr);
 	addr.sin_port = htons(FBP_DEFAULT_PORT);
 	addrlen = sizeof(addr);
+	for(i = 0; numlayers > i; i++) {
+		layeraddr[i] = addr;
+		layeraddr[i].sin_port = htons(FBP_DEFAULT_PORT + i);
+	}
 
 	bzero(&apkt, sizeof(apkt));
 	apkt.zero = 0;
@@ -321,21 +1595,82 @@ main(int argc, char **argv) {
 	apkt.fileid = fileid;
 	apkt.status = FBP_STATUS_WAITING;
 	apkt.numPackets = ceil(st.st_size / (double)FBP_PACKET_DATASIZE);
-	strncpy(apkt.filename, basename(argv[optind + 1]), sizeof(apkt.filename));
+	apkt.flags = (unicast_max > 0) ? FBP_FLAG_UNICAST : 0;
+	if(streaming) {
+		apkt.flags |= FBP_FLAG_OPEN;
+	}
+#ifdef COMPRESSION
+	if(compress_level > 0) {
+		apkt.flags |= FBP_FLAG_COMPRESSED;
+	}
+#endif
+	apkt.numLayers = numlayers;
+	apkt.serverIndex = server_index;
+	apkt.serverCount = server_count;
+	strncpy(apkt.filename, (stream_pipe != -1) ? "stdin" : basename(argv[optind + 1]), sizeof(apkt.filename));
 	apkt.filename[sizeof(apkt.filename) - 1] = 0;
 
-	sha1_file(apkt.checksum, ffd);
+	if(!streaming) {
+		sha1_file(apkt.checksum, ffd);
+	}
+	if(elide_zeros) {
+		scan_zeros(st.st_size);
+	}
+	if(publish_hashes) {
+		hash_blocks();
+		apkt.flags |= FBP_FLAG_HASHES;
+	}
+#ifdef CACHING
+	if(shcache_name != NULL) {
+		hash_packets();
+		shcache_open(shcache_name, cachesize);
+	}
+#endif
 	offset = apkt.numPackets;
 
 	BM_INIT(bitmask, apkt.numPackets);
+	BM_INIT(urgent, apkt.numPackets);
+	if(unicast_max > 0 && (reqmask = calloc(MAX(1, apkt.numPackets), 1)) == NULL) {
+		err(1, "calloc() (requester masks)");
+	}
+	if((endgame_set = calloc(MAX(1, endgame_packets), sizeof(pkt_count))) == NULL
+	 || (unicast_max > 0 && (endgame_req = calloc(MAX(1, endgame_packets), sizeof(struct endgamereq))) == NULL)) {
+		err(1, "calloc() (endgame)");
+	}
+	numblocks = (apkt.numPackets + DEMAND_BLOCK - 1) / DEMAND_BLOCK;
+	blocks = calloc(MAX(1, numblocks), sizeof(struct demandblock));
+	if(blocks == NULL) {
+		err(1, "calloc() (demand blocks)");
+	}
 
 #ifdef CACHING
-	BM_INIT(cachemask, cachesize);
-	cacheheap = malloc(cachesize * sizeof(struct cachedpacket));
-	if(cacheheap == NULL) {
-		err(1, "malloc() (cache)");
+	// With a shared cache, -c sizes that and we only need a send buffer
+	poolsize = ((shcache != NULL) ? 1 : cachesize) * sizeof(struct cachedpacket);
+#else
+	poolsize = sizeof(struct cachedpacket);
+#endif
+#ifdef COMPRESSION
+	if(compress_level > 0) {
+		poolsize += ZCACHE_GROUPS * sizeof(struct zgroup);
 	}
 #endif
+	pool_init(poolsize);
+#ifdef CACHING
+	if(shcache == NULL) {
+		BM_INIT(cachemask, cachesize);
+		cacheheap = pool_alloc(cachesize * sizeof(struct cachedpacket));
+	}
+#endif
+#ifdef COMPRESSION
+	if(compress_level > 0) {
+		zcache = pool_alloc(ZCACHE_GROUPS * sizeof(struct zgroup));
+		zspan = calloc((apkt.numPackets + FBP_COMPRESS_GROUP - 1) / FBP_COMPRESS_GROUP + 1, 1);
+		if(zspan == NULL || (zctx = ZSTD_createCCtx()) == NULL) {
+			errx(1, "can't set up compression");
+		}
+	}
+#endif
+	pool_report();
 
 	if((sfd = socket(addr.sin_family, SOCK_DGRAM, 0)) == -1) {
 		err(1, "socket");
@@ -370,10 +1705,39 @@ main(int argc, char **argv) {
 			TIMEVAL_CLEAR(nextPacket);
 		}
 #endif
+		if(!TIMEVAL_IS_ZERO(endgame_at) && !IS_PAST(endgame_at, now)) {
+			endgame_repeat();
+		}
+		// Don't let the clients wait for the next second if the queue ran dry
+		if(drained) {
+			if(packets_queued > 0) {
+				drained = 0;
+			} else if(TIMEVAL_SUBSTRACT(now, lastAnnounce) >= drain_interval || endgame_over) {
+				want_announce = 1;
+				drained = 0;
+				endgame_over = 0;
+			}
+		}
+
+		// Pick up what was appended to a growing file
+		if(streaming && stream_pipe == -1 && TIMEVAL_SUBSTRACT(now, lastPoll) >= STREAM_POLL_USEC) {
+			lastPoll = now;
+			if((grown = stream_poll()) == -1) {
+				stream_finish();
+				want_announce = 1;
+			} else if(grown && packets_queued == 0) {
+				drained = 1;
+			}
+		}
 
 		FD_ZERO(&rfds);
 		FD_ZERO(&wfds);
 		FD_SET(sfd, &rfds);
+		maxfd = sfd;
+		if(stream_pipe != -1) {
+			FD_SET(stream_pipe, &rfds);
+			maxfd = MAX(maxfd, stream_pipe);
+		}
 #ifdef RATE_LIMIT
 		if(want_announce || (packets_queued && TIMEVAL_IS_ZERO(nextPacket)))
 #else
@@ -385,10 +1749,19 @@ main(int argc, char **argv) {
 
 #ifndef RATE_LIMIT
 		if(want_announce) {
-			n = select(sfd+1, &rfds, &wfds, NULL, NULL);
+			n = select(maxfd+1, &rfds, &wfds, NULL, NULL);
 		} else {
 #endif
 			tmo.tv_usec = 999999 - now.tv_usec;
+			if(drained) {
+				tmo.tv_usec = MAX(0, MIN(tmo.tv_usec, drain_interval - TIMEVAL_SUBSTRACT(now, lastAnnounce)));
+			}
+			if(!TIMEVAL_IS_ZERO(endgame_at)) {
+				tmo.tv_usec = MAX(0, MIN(tmo.tv_usec, TIMEVAL_SUBSTRACT(endgame_at, now)));
+			}
+			if(streaming && stream_pipe == -1) {
+				tmo.tv_usec = MAX(0, MIN(tmo.tv_usec, STREAM_POLL_USEC - TIMEVAL_SUBSTRACT(now, lastPoll)));
+			}
 #ifdef RATE_LIMIT
 			if(patsts > 0 && !TIMEVAL_IS_ZERO(nextPacket)) {
 				tmo.tv_usec = MIN(tmo.tv_usec, TIMEVAL_SUBSTRACT(nextPacket, now));
@@ -409,7 +1782,7 @@ main(int argc, char **argv) {
 				prefetch_packet();
 			}
 #endif
-			n = select(sfd+1, &rfds, &wfds, NULL, &tmo);
+			n = select(maxfd+1, &rfds, &wfds, NULL, &tmo);
 #ifndef RATE_LIMIT
 		}
 #endif
@@ -423,8 +1796,13 @@ main(int argc, char **argv) {
 					if(want_announce) {
 						transmit_announce_packet();
 						want_announce = 0;
+						drained = 0;
+						lastAnnounce = now;
 					} else {
 						transmit_data_packet();
+						if(packets_queued == 0 && TIMEVAL_IS_ZERO(endgame_at)) {
+							drained = 1;
+						}
 #ifdef RATE_LIMIT
 						// printf("Sent %d/%d packet this second\n", limit_pps - patsts, limit_pps);
 						assert(TIMEVAL_IS_ZERO(nextPacket));
@@ -445,6 +1823,14 @@ main(int argc, char **argv) {
 				if(FD_ISSET(sfd, &rfds)) {
 					receive_packet();
 				}
+				if(stream_pipe != -1 && FD_ISSET(stream_pipe, &rfds)) {
+					if((grown = stream_poll()) == -1) {
+						stream_finish();
+						want_announce = 1;
+					} else if(grown && packets_queued == 0) {
+						drained = 1;
+					}
+				}
 				break;
 		}
 	}